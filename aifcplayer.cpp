@@ -8,10 +8,32 @@ static uint32_t READ_IEEE754(const uint8_t *p) {
 	return (m >> exp);
 }
 
-AifcPlayer::AifcPlayer() {
+AifcPlayer::AifcPlayer()
+	: _ssndSize(0), _thread(0), _quit(false), _ring(0), _underruns(0) {
+	SDL_AtomicSet(&_readPos, 0);
+	SDL_AtomicSet(&_writePos, 0);
+	_lock = SDL_CreateMutex();
+	_cond = SDL_CreateCond();
+}
+
+AifcPlayer::~AifcPlayer() {
+	stop();
+	SDL_DestroyCond(_cond);
+	SDL_DestroyMutex(_lock);
+	if (_ring) {
+		free(_ring);
+	}
 }
 
 bool AifcPlayer::play(int mixRate, const char *path, uint32_t startOffset) {
+	stop();
+	if (!_ring) {
+		_ring = (int16_t *)malloc(kRingSize * sizeof(int16_t));
+		if (!_ring) {
+			warning("Failed to allocate %d bytes (AifcPlayer)", kRingSize * sizeof(int16_t));
+			return false;
+		}
+	}
 	_ssndSize = 0;
 	if (_f.open(path)) {
 		_f.seek(startOffset);
@@ -75,41 +97,127 @@ bool AifcPlayer::play(int mixRate, const char *path, uint32_t startOffset) {
 			}
 		}
 	}
+	_ssndSize &= ~1; // left and right samples
+	if (_ssndSize == 0) {
+		_f.close();
+		return false;
+	}
+	_f.seek(_ssndOffset);
 	_pos = 0;
 	_sampleL = _sampleR = 0;
-	return _ssndSize != 0;
+	SDL_AtomicSet(&_readPos, 0);
+	SDL_AtomicSet(&_writePos, 0);
+	_underruns = 0;
+	// the first block is ready before the callback is hooked
+	if (!decodeBlock()) {
+		_f.close();
+		return false;
+	}
+	_quit = false;
+	_thread = SDL_CreateThread(readerThread, "AifcPlayer", this);
+	if (!_thread) {
+		warning("Unable to create AIFF-C reader thread");
+		_f.close();
+		return false;
+	}
+	return true;
 }
 
 void AifcPlayer::stop() {
+	if (_thread) {
+		SDL_LockMutex(_lock);
+		_quit = true;
+		SDL_CondSignal(_cond);
+		SDL_UnlockMutex(_lock);
+		SDL_WaitThread(_thread, 0);
+		_thread = 0;
+		if (_underruns != 0) {
+			debug(DBG_SND, "AIFF-C %d underruns", _underruns);
+		}
+	}
 	_f.close();
 }
 
+int AifcPlayer::readerThread(void *data) {
+	AifcPlayer *p = (AifcPlayer *)data;
+	SDL_LockMutex(p->_lock);
+	while (!p->_quit) {
+		const uint32_t readPos = SDL_AtomicGet(&p->_readPos);
+		const uint32_t writePos = SDL_AtomicGet(&p->_writePos);
+		if (kRingSize - (writePos - readPos) < (uint32_t)kBlockSize) {
+			SDL_CondWaitTimeout(p->_cond, p->_lock, 10);
+			continue;
+		}
+		SDL_UnlockMutex(p->_lock);
+		const bool ret = p->decodeBlock();
+		SDL_LockMutex(p->_lock);
+		if (!ret) {
+			break;
+		}
+	}
+	SDL_UnlockMutex(p->_lock);
+	return 0;
+}
+
 static int16_t decodeSDX2(int16_t prev, int8_t data) {
 	const int sqr = data * ABS(data) * 2;
 	return (data & 1) != 0 ? prev + sqr : sqr;
 }
 
-int8_t AifcPlayer::readSampleData() {
+// reads kBlockSize bytes (less at the end of the chunk) and appends the decoded samples to the ring
+bool AifcPlayer::decodeBlock() {
 	if (_pos >= _ssndSize) {
 		_pos = 0;
 		_f.seek(_ssndOffset);
 	}
-	const int8_t data = _f.readByte();
-	++_pos;
-	return data;
-}
-
-void AifcPlayer::decodeSamples() {
-	for (uint32_t pos = _rate.getInt(); pos == _rate.getInt(); _rate.offset += _rate.inc) {
-		_sampleL = decodeSDX2(_sampleL, readSampleData());
-		_sampleR = decodeSDX2(_sampleR, readSampleData());
+	uint32_t count = _ssndSize - _pos;
+	if (count > (uint32_t)kBlockSize) {
+		count = kBlockSize;
+	}
+	if (_f.read(_block, count) != (int)count || _f.ioErr()) {
+		warning("Failed to read AIFF-C data at offset 0x%x", _ssndOffset + _pos);
+		return false;
+	}
+	_pos += count;
+	uint32_t writePos = SDL_AtomicGet(&_writePos);
+	int16_t sampleL = _sampleL;
+	int16_t sampleR = _sampleR;
+	for (uint32_t i = 0; i < count; i += 2) {
+		sampleL = decodeSDX2(sampleL, _block[i]);
+		sampleR = decodeSDX2(sampleR, _block[i + 1]);
+		_ring[writePos & (kRingSize - 1)] = sampleL;
+		_ring[(writePos + 1) & (kRingSize - 1)] = sampleR;
+		writePos += 2;
 	}
+	_sampleL = sampleL;
+	_sampleR = sampleR;
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicSet(&_writePos, writePos);
+	return true;
 }
 
 void AifcPlayer::readSamples(int16_t *buf, int len) {
-	for (int i = 0; i < len; i += 2) {
-		decodeSamples();
-		*buf++ = _sampleL;
-		*buf++ = _sampleR;
+	uint32_t readPos = SDL_AtomicGet(&_readPos);
+	const uint32_t writePos = SDL_AtomicGet(&_writePos);
+	SDL_MemoryBarrierAcquire();
+	const uint32_t frames = (writePos - readPos) / 2;
+	int i = 0;
+	for (; i < len; i += 2) {
+		const uint32_t frame = _rate.getInt();
+		if (frame >= frames) {
+			++_underruns;
+			memset(buf + i, 0, (len - i) * sizeof(int16_t));
+			break;
+		}
+		const uint32_t pos = readPos + frame * 2;
+		buf[i] = _ring[pos & (kRingSize - 1)];
+		buf[i + 1] = _ring[(pos + 1) & (kRingSize - 1)];
+		_rate.offset += _rate.inc;
+	}
+	uint32_t consumed = _rate.getInt();
+	if (consumed > frames) {
+		consumed = frames;
 	}
+	_rate.offset -= ((uint64_t)consumed) << Frac::BITS;
+	SDL_AtomicSet(&_readPos, readPos + consumed * 2);
 }
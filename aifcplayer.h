@@ -2,25 +2,46 @@
 #ifndef AIFC_PLAYER_H__
 #define AIFC_PLAYER_H__
 
+#include <SDL.h>
 #include "intern.h"
 #include "file.h"
 
+// The SSND chunk is read and decoded by a background thread into a ring
+// buffer, the audio callback only resamples from it.
 struct AifcPlayer {
 
+	enum {
+		kRingSize = 65536 * 2, // stereo samples, must be a power of 2
+		kBlockSize = 16384, // SDX2 bytes read and decoded at once
+	};
+
+	// owned by the reader thread once playing
 	File _f;
 	uint32_t _ssndOffset;
 	uint32_t _ssndSize;
 	uint32_t _pos;
 	int16_t _sampleL, _sampleR;
+	int8_t _block[kBlockSize];
+
+	SDL_Thread *_thread;
+	SDL_mutex *_lock;
+	SDL_cond *_cond;
+	bool _quit;
+
+	// ring buffer, written by the reader thread and read by the audio callback
+	int16_t *_ring;
+	SDL_atomic_t _readPos, _writePos;
 	Frac _rate;
+	int _underruns;
 
 	AifcPlayer();
+	~AifcPlayer();
 
 	bool play(int mixRate, const char *path, uint32_t offset);
 	void stop();
 
-	int8_t readSampleData();
-	void decodeSamples();
+	static int readerThread(void *data);
+	bool decodeBlock();
 	void readSamples(int16_t *buf, int len);
 };
 
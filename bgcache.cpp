@@ -0,0 +1,249 @@
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bgcache.h"
+#include "bitmap.h"
+#include "file.h"
+#include "util.h"
+
+static const uint32_t kCacheVersion = 1;
+
+static uint32_t hashPath(const char *path) {
+	uint32_t hash = 2166136261U; // FNV-1a
+	for (; *path; ++path) {
+		hash ^= (uint8_t)*path;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static bool getSourceStat(const char *srcPath, uint32_t *size, uint32_t *mtime) {
+	struct stat s;
+	if (stat(srcPath, &s) != 0) {
+		return false;
+	}
+	*size = s.st_size;
+	*mtime = s.st_mtime;
+	return true;
+}
+
+static bool getCacheFilePath(const char *cachePath, uint32_t hash, char *out, int outSize) {
+	return snprintf(out, outSize, "%s/bg_%08x.bin", cachePath, hash) < outSize;
+}
+
+BackgroundCache::BackgroundCache()
+	: _raw(0), _buffer(0), _hits(0), _misses(0), _files(0), _filesCount(0), _filesCapacity(0), _totalSize(0), _useCounter(0) {
+	_cachePath[0] = 0;
+}
+
+BackgroundCache::~BackgroundCache() {
+	debug(DBG_RESOURCE, "BackgroundCache hits %d misses %d files %d size %d", _hits, _misses, _filesCount, _totalSize);
+	free(_raw);
+	free(_files);
+}
+
+bool BackgroundCache::init(const char *dataPath) {
+	if (snprintf(_cachePath, sizeof(_cachePath), "%s/cache", dataPath) >= (int)sizeof(_cachePath)) {
+		warning("Background cache path too long for '%s'", dataPath);
+		return false;
+	}
+	struct stat s;
+	if (stat(_cachePath, &s) != 0 && mkdir(_cachePath, 0777) != 0) {
+		warning("Unable to create background cache directory '%s'", _cachePath);
+		return false;
+	}
+	// header and pixels are read together, the pixels land at a sector aligned offset
+	_raw = (uint8_t *)malloc(kHeaderSize + kDataSize);
+	if (!_raw) {
+		warning("Failed to allocate %d bytes (BackgroundCache)", kHeaderSize + kDataSize);
+		return false;
+	}
+	_buffer = (uint16_t *)(_raw + kHeaderSize);
+	if (!scanFiles()) {
+		warning("Unable to list the background cache directory '%s'", _cachePath);
+	}
+	return true;
+}
+
+static int compareFileLastUse(const void *a, const void *b) {
+	const uint32_t lastUseA = ((const BackgroundCacheFile *)a)->lastUse;
+	const uint32_t lastUseB = ((const BackgroundCacheFile *)b)->lastUse;
+	return (lastUseA < lastUseB) ? -1 : ((lastUseA > lastUseB) ? 1 : 0);
+}
+
+bool BackgroundCache::scanFiles() {
+	DIR *d = opendir(_cachePath);
+	if (!d) {
+		return false;
+	}
+	dirent *de;
+	while ((de = readdir(d)) != NULL) {
+		unsigned int hash;
+		if (strlen(de->d_name) != 15 || sscanf(de->d_name, "bg_%08x.bin", &hash) != 1) {
+			continue;
+		}
+		char path[MAXPATHLEN];
+		struct stat s;
+		if (!getCacheFilePath(_cachePath, hash, path, sizeof(path)) || stat(path, &s) != 0) {
+			continue;
+		}
+		// ordered by modification time below
+		if (!addFile(hash, s.st_size, s.st_mtime)) {
+			break;
+		}
+	}
+	closedir(d);
+	qsort(_files, _filesCount, sizeof(BackgroundCacheFile), compareFileLastUse);
+	for (int i = 0; i < _filesCount; ++i) {
+		_files[i].lastUse = ++_useCounter;
+	}
+	debug(DBG_RESOURCE, "BackgroundCache::scanFiles() files %d size %d", _filesCount, _totalSize);
+	return true;
+}
+
+BackgroundCacheFile *BackgroundCache::findFile(uint32_t hash) {
+	for (int i = 0; i < _filesCount; ++i) {
+		if (_files[i].hash == hash) {
+			return &_files[i];
+		}
+	}
+	return 0;
+}
+
+bool BackgroundCache::addFile(uint32_t hash, uint32_t size, uint32_t lastUse) {
+	if (_filesCount == _filesCapacity) {
+		const int capacity = _filesCapacity ? _filesCapacity * 2 : 64;
+		BackgroundCacheFile *tmp = (BackgroundCacheFile *)realloc(_files, capacity * sizeof(BackgroundCacheFile));
+		if (!tmp) {
+			warning("Failed to allocate %d entries (BackgroundCache)", capacity);
+			return false;
+		}
+		_files = tmp;
+		_filesCapacity = capacity;
+	}
+	BackgroundCacheFile *f = &_files[_filesCount++];
+	f->hash = hash;
+	f->size = size;
+	f->lastUse = lastUse;
+	_totalSize += size;
+	return true;
+}
+
+void BackgroundCache::removeFile(int index) {
+	_totalSize -= _files[index].size;
+	_files[index] = _files[--_filesCount];
+}
+
+static bool checkHeader(const uint8_t *hdr, const char *srcPath) {
+	uint32_t srcSize, srcMtime;
+	if (!getSourceStat(srcPath, &srcSize, &srcMtime) || memcmp(hdr, "AWBG", 4) != 0) {
+		return false;
+	}
+	if (READ_LE_UINT32(hdr + 4) != kCacheVersion || READ_LE_UINT32(hdr + 8) != srcSize || READ_LE_UINT32(hdr + 12) != srcMtime) {
+		return false;
+	}
+	if (READ_LE_UINT16(hdr + 16) != BackgroundCache::kWidth || READ_LE_UINT16(hdr + 18) != BackgroundCache::kHeight) {
+		return false;
+	}
+	const int len = READ_LE_UINT16(hdr + 20);
+	return len == (int)strlen(srcPath) && memcmp(hdr + 22, srcPath, len) == 0;
+}
+
+bool BackgroundCache::isCached(const char *srcPath) {
+	const uint32_t hash = hashPath(srcPath);
+	char path[MAXPATHLEN];
+	if (!findFile(hash) || !getCacheFilePath(_cachePath, hash, path, sizeof(path))) {
+		return false;
+	}
+	File f;
+	uint8_t hdr[kHeaderSize];
+	return f.open(path) && f.read(hdr, kHeaderSize) == kHeaderSize && checkHeader(hdr, srcPath);
+}
+
+const uint16_t *BackgroundCache::load(const char *srcPath) {
+	const uint32_t hash = hashPath(srcPath);
+	BackgroundCacheFile *cf = findFile(hash);
+	char path[MAXPATHLEN];
+	File f;
+	if (cf && getCacheFilePath(_cachePath, hash, path, sizeof(path)) && f.open(path) && f.read(_raw, kHeaderSize + kDataSize) == kHeaderSize + kDataSize && checkHeader(_raw, srcPath)) {
+		cf->lastUse = ++_useCounter;
+		++_hits;
+		return _buffer;
+	}
+	++_misses;
+	return 0;
+}
+
+const uint16_t *BackgroundCache::convert(const char *srcPath, const uint8_t *bmp) {
+	int w, h;
+	const uint8_t *rgb = decode_bitmap(bmp, false, -1, &w, &h, BITMAP_TYPE_BACKGROUND);
+	if (!rgb) {
+		return 0;
+	}
+	scale_bitmap_toRGB5551(rgb, w, h, _buffer, kWidth, kHeight);
+	save(srcPath);
+	return _buffer;
+}
+
+bool BackgroundCache::save(const char *srcPath) {
+	uint32_t srcSize, srcMtime;
+	const int len = strlen(srcPath);
+	const uint32_t hash = hashPath(srcPath);
+	char path[MAXPATHLEN];
+	if (!getSourceStat(srcPath, &srcSize, &srcMtime) || 22 + len > kHeaderSize || !getCacheFilePath(_cachePath, hash, path, sizeof(path))) {
+		return false;
+	}
+	// a stale file is overwritten, it no longer counts against the size limit
+	BackgroundCacheFile *cf = findFile(hash);
+	if (cf) {
+		removeFile(cf - _files);
+	}
+	trim(kHeaderSize + kDataSize);
+	uint8_t *hdr = _raw;
+	memset(hdr, 0, kHeaderSize);
+	memcpy(hdr, "AWBG", 4);
+	WRITE_LE_UINT32(hdr + 4, kCacheVersion);
+	WRITE_LE_UINT32(hdr + 8, srcSize);
+	WRITE_LE_UINT32(hdr + 12, srcMtime);
+	hdr[16] = kWidth & 255; hdr[17] = kWidth >> 8;
+	hdr[18] = kHeight & 255; hdr[19] = kHeight >> 8;
+	hdr[20] = len & 255; hdr[21] = len >> 8;
+	memcpy(hdr + 22, srcPath, len);
+	File f;
+	if (!f.openForWriting(path)) {
+		warning("Unable to create '%s'", path);
+		unlink(path); // the previous file, if any, is no longer tracked
+		return false;
+	}
+	f.write(_raw, kHeaderSize + kDataSize);
+	if (f.ioErr()) {
+		warning("Failed to write '%s'", path);
+		f.close();
+		unlink(path);
+		return false;
+	}
+	if (!addFile(hash, kHeaderSize + kDataSize, ++_useCounter)) {
+		f.close();
+		unlink(path);
+		return false;
+	}
+	return true;
+}
+
+void BackgroundCache::trim(uint32_t incomingSize) {
+	while (_totalSize + incomingSize > _maxSize && _filesCount > 0) {
+		int oldest = 0;
+		for (int i = 1; i < _filesCount; ++i) {
+			if (_files[i].lastUse < _files[oldest].lastUse) {
+				oldest = i;
+			}
+		}
+		char path[MAXPATHLEN];
+		if (getCacheFilePath(_cachePath, _files[oldest].hash, path, sizeof(path))) {
+			debug(DBG_RESOURCE, "BackgroundCache::trim() removing '%s'", path);
+			unlink(path);
+		}
+		removeFile(oldest);
+	}
+}
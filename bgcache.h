@@ -0,0 +1,55 @@
+
+#ifndef BGCACHE_H__
+#define BGCACHE_H__
+
+#include "intern.h"
+
+struct BackgroundCacheFile {
+	uint32_t hash; // of the source path, names the file
+	uint32_t size;
+	uint32_t lastUse;
+};
+
+// On-disk cache of the 20th anniversary edition backgrounds, stored already
+// decoded and rescaled to the PSP screen (480x272 RGB5551). The directory is
+// listed once by init(), the files are then tracked in memory. The least
+// recently loaded or saved files are removed first, the files found by
+// init() are ordered by their modification time.
+struct BackgroundCache {
+
+	enum {
+		kWidth = SCREEN_WIDTH,
+		kHeight = SCREEN_HEIGHT,
+		kHeaderSize = 512, // keeps the pixel data sector aligned
+		kDataSize = kWidth * kHeight * sizeof(uint16_t)
+	};
+
+	static bool _enabled;
+	static bool _warmOnStart;
+	static uint32_t _maxSize;
+
+	char _cachePath[MAXPATHLEN];
+	uint8_t *_raw; // header followed by the pixels
+	uint16_t *_buffer;
+	int _hits, _misses;
+	BackgroundCacheFile *_files;
+	int _filesCount, _filesCapacity;
+	uint32_t _totalSize;
+	uint32_t _useCounter;
+
+	BackgroundCache();
+	~BackgroundCache();
+
+	bool init(const char *dataPath);
+	bool scanFiles();
+	BackgroundCacheFile *findFile(uint32_t hash);
+	bool addFile(uint32_t hash, uint32_t size, uint32_t lastUse);
+	void removeFile(int index);
+	bool isCached(const char *srcPath);
+	const uint16_t *load(const char *srcPath);
+	const uint16_t *convert(const char *srcPath, const uint8_t *bmp);
+	bool save(const char *srcPath); // writes the pixels currently in _buffer
+	void trim(uint32_t incomingSize);
+};
+
+#endif
@@ -148,3 +148,16 @@ uint16_t *decode_bitmap_toRGB5551(const uint8_t *src, bool alpha, int colorKey,
 	*h = height;
 	return dst;
 }
+
+// nearest neighbour sampling, matches the FMT_RGB path of the renderers drawBitmap
+void scale_bitmap_toRGB5551(const uint8_t *rgb, int w, int h, uint16_t *dst, int dstW, int dstH) {
+	const float xFactor = (float)w / (float)dstW;
+	const float yFactor = (float)h / (float)dstH;
+	for (int j = 0; j < dstH; ++j) {
+		const uint8_t *src = rgb + int(float(j) * yFactor) * w * 3;
+		for (int i = 0; i < dstW; ++i) {
+			const uint8_t *p = src + int(float(i) * xFactor) * 3;
+			*dst++ = 0x8000 | ((p[2] >> 3) << 10) | ((p[1] >> 3) << 5) | (p[0] >> 3);
+		}
+	}
+}
@@ -6,5 +6,6 @@
 
 uint8_t *decode_bitmap(const uint8_t *src, bool alpha, int colorKey, int *w, int *h, int bitmap_type);
 uint16_t *decode_bitmap_toRGB5551(const uint8_t *src, bool alpha, int colorKey, int *w, int *h, bool flipY);
+void scale_bitmap_toRGB5551(const uint8_t *rgb, int w, int h, uint16_t *dst, int dstW, int dstH);
 
 #endif
@@ -4,11 +4,15 @@
  * Copyright (C) 2004-2005 Gregory Montoir (cyx@users.sourceforge.net)
  */
 
+#include "bgcache.h"
 #include "engine.h"
 #include "file.h"
 #include "graphics.h"
+#include "musiccache.h"
+#include "prefetcher.h"
 #include "resource_nth.h"
 #include "systemstub.h"
+#include "unpackcache.h"
 #include "util.h"
 
 
@@ -93,9 +97,15 @@ void Engine::setup(Language lang, int graphicsType, const char *scalerName, int
 	if (isNth) {
 		_res.loadFont();
 		_res.loadHeads();
+		if (BackgroundCache::_enabled) {
+			_res.initBackgroundCache(BackgroundCache::_warmOnStart);
+		}
 	} else {
 		_vid.setDefaultFont();
 	}
+	if (UnpackCache::_enabled) {
+		_res.initUnpackCache(UnpackCache::_buildOnStart);
+	}
 	_script.init();
 	MixerType mixerType = kMixerTypeRaw;
 	switch (_res.getDataType()) {
@@ -124,6 +134,18 @@ void Engine::setup(Language lang, int graphicsType, const char *scalerName, int
 		break;
 	}
 	_mix.init(mixerType);
+	if (_res._nth) {
+		_res._nth->setMixer(&_mix);
+	}
+	if (isNth && MusicCache::_enabled) {
+		if (MusicCache::_convertOnStart) {
+			MusicCache::convertAll(_res._dataDir);
+		}
+		_mix.setMusicCacheDir(_res._dataDir);
+	}
+	if (Prefetcher::_enabled) {
+		_res.initPrefetcher();
+	}
 #ifndef BYPASS_PROTECTION
 	switch (_res.getDataType()) {
 	case Resource::DT_DOS:
@@ -4,6 +4,8 @@
  * Copyright (C) 2004-2005 Gregory Montoir (cyx@users.sourceforge.net)
  */
 
+#include <SDL.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <sys/param.h>
 #include <sys/stat.h>
@@ -18,6 +20,7 @@ struct File_impl {
 	virtual bool open(const char *path, const char *mode) = 0;
 	virtual void close() = 0;
 	virtual uint32_t size() = 0;
+	virtual uint32_t tell() = 0;
 	virtual void seek(int off, int whence) = 0;
 	virtual int read(void *ptr, uint32_t len) = 0;
 	virtual int write(void *ptr, uint32_t len) = 0;
@@ -47,6 +50,9 @@ struct stdFile : File_impl {
 		}
 		return sz;
 	}
+	uint32_t tell() {
+		return _fp ? ftell(_fp) : 0;
+	}
 	void seek(int off, int whence) {
 		if (_fp) {
 			fseek(_fp, off, whence);
@@ -74,37 +80,182 @@ struct stdFile : File_impl {
 	}
 };
 
-File::File() {
+File::File()
+	: _readBuf(0), _readBufStart(0), _readBufPos(0), _readBufLen(0), _readMode(false) {
 	_impl = new stdFile;
 }
 
 File::~File() {
 	_impl->close();
 	delete _impl;
+	if (_readBuf) {
+		free(_readBuf);
+	}
+}
+
+static bool openForReading(File *f, const char *filepath) {
+	f->_readBufStart = f->_readBufPos = f->_readBufLen = 0;
+	if (!f->_readBuf) {
+		f->_readBuf = (uint8_t *)malloc(File::kReadBufferSize);
+	}
+	f->_readMode = (f->_readBuf != 0);
+	return f->_impl->open(filepath, "rb");
 }
 
 bool File::open(const char *filepath) {
 	_impl->close();
-	return _impl->open(filepath, "rb");
+	return openForReading(this, filepath);
 }
 
-static bool getFilePathNoCase(const char *filename, const char *path, char *out) {
-	bool ret = false;
+// case-folded hash index of a directory, rebuilt when its modification time changes
+struct DirIndex {
+	char path[MAXPATHLEN];
+	time_t mtime;
+	int count;
+	char *names; // original names, nul terminated
+	uint32_t *offsets; // in names
+	int *table; // index + 1 of the entry, 0 if empty
+	uint32_t tableMask;
+	uint32_t lastUse;
+};
+
+static const int kDirIndexCount = 8;
+static DirIndex _dirIndexes[kDirIndexCount];
+static uint32_t _dirIndexesCounter;
+static SDL_mutex *_dirIndexesLock; // held while a directory is read
+static SDL_SpinLock _dirIndexesLockCreate;
+
+static uint32_t hashNoCase(const char *s) {
+	uint32_t hash = 2166136261u; // FNV-1a
+	for (; *s; ++s) {
+		hash = (hash ^ (uint8_t)tolower(*s)) * 16777619u;
+	}
+	return hash;
+}
+
+static void freeDirIndex(DirIndex *di) {
+	if (di->names) {
+		free(di->names);
+	}
+	if (di->offsets) {
+		free(di->offsets);
+	}
+	if (di->table) {
+		free(di->table);
+	}
+	memset(di, 0, sizeof(DirIndex));
+}
+
+static bool buildDirIndex(DirIndex *di, const char *path, time_t mtime) {
 	DIR *d = opendir(path);
-	if (d) {
-		dirent *de;
-		while ((de = readdir(d)) != NULL) {
-			if (de->d_name[0] == '.') {
-				continue;
+	if (!d) {
+		return false;
+	}
+	int count = 0;
+	uint32_t namesSize = 0;
+	dirent *de;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] != '.') {
+			++count;
+			namesSize += strlen(de->d_name) + 1;
+		}
+	}
+	uint32_t tableSize = 16;
+	while (tableSize < (uint32_t)count * 2) {
+		tableSize *= 2;
+	}
+	di->names = (char *)malloc(namesSize + 1);
+	di->offsets = (uint32_t *)malloc((count + 1) * sizeof(uint32_t));
+	di->table = (int *)calloc(tableSize, sizeof(int));
+	if (!di->names || !di->offsets || !di->table) {
+		closedir(d);
+		freeDirIndex(di);
+		return false;
+	}
+	di->tableMask = tableSize - 1;
+	rewinddir(d);
+	uint32_t offset = 0;
+	int i = 0;
+	while ((de = readdir(d)) != NULL && i < count) {
+		if (de->d_name[0] == '.') {
+			continue;
+		}
+		const int len = strlen(de->d_name);
+		if (offset + len + 1 > namesSize) {
+			break;
+		}
+		memcpy(di->names + offset, de->d_name, len + 1);
+		di->offsets[i] = offset;
+		offset += len + 1;
+		uint32_t h = hashNoCase(de->d_name) & di->tableMask;
+		while (di->table[h] != 0) {
+			h = (h + 1) & di->tableMask;
+		}
+		di->table[h] = i + 1;
+		++i;
+	}
+	closedir(d);
+	di->count = i;
+	strncpy(di->path, path, sizeof(di->path) - 1);
+	di->path[sizeof(di->path) - 1] = 0;
+	di->mtime = mtime;
+	debug(DBG_INFO, "Indexed %d files in '%s'", di->count, path);
+	return true;
+}
+
+static DirIndex *getDirIndex(const char *path) {
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		return 0;
+	}
+	DirIndex *lru = &_dirIndexes[0];
+	for (int i = 0; i < kDirIndexCount; ++i) {
+		DirIndex *di = &_dirIndexes[i];
+		if (di->names && strcmp(di->path, path) == 0) {
+			if (di->mtime == st.st_mtime) {
+				di->lastUse = ++_dirIndexesCounter;
+				return di;
 			}
-			if (strcasecmp(de->d_name, filename) == 0) {
-				sprintf(out, "%s/%s", path, de->d_name);
+			lru = di; // directory modified
+			break;
+		}
+		if (di->lastUse < lru->lastUse) {
+			lru = di;
+		}
+	}
+	freeDirIndex(lru);
+	if (!buildDirIndex(lru, path, st.st_mtime)) {
+		return 0;
+	}
+	lru->lastUse = ++_dirIndexesCounter;
+	return lru;
+}
+
+static SDL_mutex *getDirIndexesLock() {
+	SDL_AtomicLock(&_dirIndexesLockCreate);
+	if (!_dirIndexesLock) {
+		_dirIndexesLock = SDL_CreateMutex();
+	}
+	SDL_AtomicUnlock(&_dirIndexesLockCreate);
+	return _dirIndexesLock;
+}
+
+static bool getFilePathNoCase(const char *filename, const char *path, char *out) {
+	bool ret = false;
+	SDL_mutex *lock = getDirIndexesLock();
+	SDL_LockMutex(lock);
+	DirIndex *di = getDirIndex(path);
+	if (di) {
+		for (uint32_t h = hashNoCase(filename) & di->tableMask; di->table[h] != 0; h = (h + 1) & di->tableMask) {
+			const char *name = di->names + di->offsets[di->table[h] - 1];
+			if (strcasecmp(name, filename) == 0) {
+				snprintf(out, MAXPATHLEN, "%s/%s", path, name);
 				ret = true;
 				break;
 			}
 		}
-		closedir(d);
 	}
+	SDL_UnlockMutex(lock);
 	return ret;
 }
 
@@ -112,18 +263,28 @@ bool File::open(const char *filename, const char *path) {
 	_impl->close();
 	char filepath[MAXPATHLEN];
 	if (getFilePathNoCase(filename, path, filepath)) {
-		return _impl->open(filepath, "rb");
+		return openForReading(this, filepath);
 	}
 	return false;
 }
 
 bool File::openForWriting(const char *filepath) {
 	_impl->close();
+	_readBufPos = _readBufLen = 0;
+	_readMode = false;
 	return _impl->open(filepath, "wb");
 }
 
+bool File::openForAppending(const char *filepath) {
+	_impl->close();
+	_readBufPos = _readBufLen = 0;
+	_readMode = false;
+	return _impl->open(filepath, "ab");
+}
+
 void File::close() {
 	_impl->close();
+	_readBufPos = _readBufLen = 0;
 }
 
 bool File::ioErr() const {
@@ -135,43 +296,80 @@ uint32_t File::size() {
 }
 
 void File::seek(int off, int whence) {
+	if (_readBufLen != 0) {
+		// stay in the read-ahead window when possible
+		int pos = -1;
+		if (whence == SEEK_SET) {
+			pos = off - (int)_readBufStart;
+		} else if (whence == SEEK_CUR) {
+			pos = (int)_readBufPos + off;
+			// the underlying file is positioned at the end of the window
+			off -= (int)(_readBufLen - _readBufPos);
+		}
+		if (pos >= 0 && pos <= (int)_readBufLen) {
+			_readBufPos = pos;
+			return;
+		}
+		_readBufPos = _readBufLen = 0;
+	}
 	_impl->seek(off, whence);
 }
 
+bool File::fillReadBuffer() {
+	_readBufStart = _impl->tell();
+	// reaching the end of the file is not an error until the caller asks for more than what is left
+	const bool ioErr = _impl->_ioErr;
+	const int count = _impl->read(_readBuf, kReadBufferSize);
+	_impl->_ioErr = ioErr;
+	_readBufPos = 0;
+	_readBufLen = (count > 0) ? count : 0;
+	return _readBufLen != 0;
+}
+
 int File::read(void *ptr, uint32_t len) {
-	return _impl->read(ptr, len);
+	if (!_readMode) {
+		return _impl->read(ptr, len);
+	}
+	uint8_t *dst = (uint8_t *)ptr;
+	uint32_t count = _readBufLen - _readBufPos;
+	if (count > len) {
+		count = len;
+	}
+	memcpy(dst, _readBuf + _readBufPos, count);
+	_readBufPos += count;
+	len -= count;
+	if (len >= kReadBufferSize) {
+		// large reads go straight to the destination
+		_readBufPos = _readBufLen = 0;
+		count += _impl->read(dst + count, len);
+	} else if (len != 0) {
+		fillReadBuffer();
+		uint32_t n = _readBufLen;
+		if (n > len) {
+			n = len;
+		} else if (n < len) {
+			_impl->_ioErr = true;
+		}
+		memcpy(dst + count, _readBuf, n);
+		_readBufPos = n;
+		count += n;
+	}
+	return count;
 }
 
-uint8_t File::readByte() {
-	uint8_t b;
+uint8_t File::readByteSlow() {
+	if (_readMode) {
+		if (fillReadBuffer()) {
+			return _readBuf[_readBufPos++];
+		}
+		_impl->_ioErr = true;
+		return 0;
+	}
+	uint8_t b = 0;
 	read(&b, 1);
 	return b;
 }
 
-uint16_t File::readUint16LE() {
-	uint8_t lo = readByte();
-	uint8_t hi = readByte();
-	return (hi << 8) | lo;
-}
-
-uint32_t File::readUint32LE() {
-	uint16_t lo = readUint16LE();
-	uint16_t hi = readUint16LE();
-	return (hi << 16) | lo;
-}
-
-uint16_t File::readUint16BE() {
-	uint8_t hi = readByte();
-	uint8_t lo = readByte();
-	return (hi << 8) | lo;
-}
-
-uint32_t File::readUint32BE() {
-	uint16_t hi = readUint16BE();
-	uint16_t lo = readUint16BE();
-	return (hi << 16) | lo;
-}
-
 int File::write(void *ptr, uint32_t len) {
 	return _impl->write(ptr, len);
 }
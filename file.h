@@ -13,24 +13,67 @@
 struct File_impl;
 
 struct File {
+	enum {
+		kReadBufferSize = 4096
+	};
+
 	File();
 	~File();
 
 	File_impl *_impl;
+	// read-ahead window for files opened for reading, the integer readers are served from it
+	uint8_t *_readBuf;
+	uint32_t _readBufStart; // file offset of _readBuf[0]
+	uint32_t _readBufPos, _readBufLen;
+	bool _readMode;
 
 	bool open(const char *filepath);
 	bool open(const char *filename, const char *path);
 	bool openForWriting(const char *filepath);
+	bool openForAppending(const char *filepath);
 	void close();
 	bool ioErr() const;
 	uint32_t size();
 	void seek(int off, int whence = SEEK_SET);
 	int read(void *ptr, uint32_t len);
-	uint8_t readByte();
-	uint16_t readUint16LE();
-	uint32_t readUint32LE();
-	uint16_t readUint16BE();
-	uint32_t readUint32BE();
+	uint8_t readByte() {
+		if (_readBufPos < _readBufLen) {
+			return _readBuf[_readBufPos++];
+		}
+		return readByteSlow();
+	}
+	uint16_t readUint16LE() {
+		if (_readBufLen - _readBufPos >= 2) {
+			const uint8_t *p = _readBuf + _readBufPos;
+			_readBufPos += 2;
+			return (p[1] << 8) | p[0];
+		}
+		const uint8_t lo = readByte();
+		const uint8_t hi = readByte();
+		return (hi << 8) | lo;
+	}
+	uint32_t readUint32LE() {
+		const uint16_t lo = readUint16LE();
+		const uint16_t hi = readUint16LE();
+		return (hi << 16) | lo;
+	}
+	uint16_t readUint16BE() {
+		if (_readBufLen - _readBufPos >= 2) {
+			const uint8_t *p = _readBuf + _readBufPos;
+			_readBufPos += 2;
+			return (p[0] << 8) | p[1];
+		}
+		const uint8_t hi = readByte();
+		const uint8_t lo = readByte();
+		return (hi << 8) | lo;
+	}
+	uint32_t readUint32BE() {
+		const uint16_t hi = readUint16BE();
+		const uint16_t lo = readUint16BE();
+		return (hi << 16) | lo;
+	}
+	uint8_t readByteSlow();
+	bool fillReadBuffer();
 	int write(void *ptr, uint32_t size);
 	void writeByte(uint8_t b);
 	void writeUint16LE(uint16_t n);
@@ -9,6 +9,7 @@ enum {
 	FMT_RGB555,
 	FMT_RGB,
 	FMT_RGBA,
+	FMT_RGB5551, // SCREEN_WIDTH x SCREEN_HEIGHT, already scaled
 };
 
 enum {
@@ -326,6 +326,9 @@ void GraphicsPSP::drawBitmap(int listNum, const uint8_t *data, int w, int h, int
 				case FMT_RGBA:
 					// TODO
 					break;
+				case FMT_RGB5551:
+					color = ((const uint16_t*)data)[j * SCREEN_WIDTH + i];
+					break;
 			}
 			_colorBuffer[address++] = color;
 		}
@@ -551,6 +551,16 @@ void GraphicsSoft::drawBitmap(int buffer, const uint8_t *data, int w, int h, int
 			memset(getPagePtr(buffer), 0xFF, getPageSize());
 			return;
 		}
+		if (fmt == FMT_RGB5551 && w == _w && h == _h)
+		{
+			const uint16_t *src = (const uint16_t *)data;
+			for (int i = 0; i < _w * _h; i++)
+			{
+				_bmpBackground[i] = src[i] & 0x7FFF;
+			}
+			memset(getPagePtr(buffer), 0xFF, getPageSize());
+			return;
+		}
 		break;
 	case 2:
 		if (fmt == FMT_RGB555) {
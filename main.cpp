@@ -7,12 +7,18 @@
 #include <SDL.h>
 #include <getopt.h>
 #include <sys/stat.h>
+#include "bgcache.h"
 #include "engine.h"
 #include "graphics.h"
 #include "resource.h"
+#include "resource_nth.h"
 #include "systemstub.h"
 #include "util.h"
 #include "mixer.h"
+#include "musiccache.h"
+#include "prefetcher.h"
+#include "sfxplayer.h"
+#include "unpackcache.h"
 
 #include "menu.h"
 
@@ -52,12 +58,36 @@ static const struct {
 	{ 0,  -1 }
 };
 
+static const struct {
+	int freq;
+	int samples;
+} MIX_SETTINGS[] = {
+	{ 44100, 4096 },
+	{ 44100, 1024 },
+	{ 48000, 1024 },
+	{ 32000, 1024 },
+	{ 22050, 512 }
+};
+
 bool Graphics::_is1991 = false;
 bool Graphics::_use555 = false;
 bool Video::_useEGA = false;
 Difficulty Script::_difficulty = DIFFICULTY_NORMAL;
 bool Script::_useRemasteredAudio = true;
 bool Mixer::_isMusicActive = true;
+int Mixer::_mixFreq = 44100;
+int Mixer::_mixSamples = 4096;
+bool SfxPlayer::_lockstep = false;
+bool SfxPlayer::_prerender = false;
+bool BackgroundCache::_enabled = false;
+bool BackgroundCache::_warmOnStart = false;
+uint32_t BackgroundCache::_maxSize = 64 * 1024 * 1024;
+bool MusicCache::_enabled = false;
+bool MusicCache::_convertOnStart = false;
+bool UnpackCache::_enabled = false;
+bool UnpackCache::_buildOnStart = false;
+bool Prefetcher::_enabled = true;
+bool ResourceNth::_useHdDats = false;
 
 static Graphics *createGraphics(int type) {
 	switch (type) {
@@ -147,6 +177,29 @@ int main(int argc, char *argv[]) {
 	Script::_difficulty = (Difficulty)menu->_entries[menu->MenuEntryDifficulty].selectedOption;
 	Mixer::_isMusicActive = menu->_entries[menu->MenuEntryMusic].selectedBinary;
 	demo3JoyInputs = menu->_entries[menu->MenuEntryDemoInputs].selectedBinary;
+	if (menu->MenuEntryMusicLockstep > -1)
+	{
+		SfxPlayer::_lockstep = menu->_entries[menu->MenuEntryMusicLockstep].selectedBinary;
+	}
+	if (menu->MenuEntryMusicPrerender > -1)
+	{
+		SfxPlayer::_prerender = menu->_entries[menu->MenuEntryMusicPrerender].selectedBinary;
+	}
+	if (menu->MenuEntryCache > -1)
+	{
+		BackgroundCache::_enabled = menu->_entries[menu->MenuEntryCache].selectedOption != 0;
+		BackgroundCache::_warmOnStart = menu->_entries[menu->MenuEntryCache].selectedOption == 2;
+		MusicCache::_enabled = BackgroundCache::_enabled;
+		MusicCache::_convertOnStart = BackgroundCache::_warmOnStart;
+		UnpackCache::_enabled = BackgroundCache::_enabled;
+		UnpackCache::_buildOnStart = BackgroundCache::_warmOnStart;
+	}
+	if (menu->MenuEntryHdDats > -1)
+	{
+		ResourceNth::_useHdDats = menu->_entries[menu->MenuEntryHdDats].selectedBinary;
+	}
+	Mixer::_mixFreq = MIX_SETTINGS[menu->_entries[menu->MenuEntryAudioOutput].selectedOption].freq;
+	Mixer::_mixSamples = MIX_SETTINGS[menu->_entries[menu->MenuEntryAudioOutput].selectedOption].samples;
 
 	delete menu;
 
@@ -118,6 +118,26 @@ void Menu::init(int8_t resourceType)
                 _numEntries++;
             }
 
+            MenuEntryMusicLockstep = -1;
+            if (resourceType == Resource::DT_DOS || resourceType == Resource::DT_AMIGA || resourceType == Resource::DT_ATARI)
+            {
+                _entries[_numEntries].name = "Sync music to frames";
+                _entries[_numEntries].type = MenuEntryTypeBinary;
+                _entries[_numEntries].selectedBinary = false;
+                MenuEntryMusicLockstep = _numEntries;
+                _numEntries++;
+            }
+
+            MenuEntryMusicPrerender = -1;
+            if (resourceType == Resource::DT_DOS || resourceType == Resource::DT_AMIGA || resourceType == Resource::DT_ATARI)
+            {
+                _entries[_numEntries].name = "Pre-render music";
+                _entries[_numEntries].type = MenuEntryTypeBinary;
+                _entries[_numEntries].selectedBinary = false;
+                MenuEntryMusicPrerender = _numEntries;
+                _numEntries++;
+            }
+
             if (resourceType == Resource::DT_20TH_EDITION)
             {
                 _entries[_numEntries].name = "Difficulty";
@@ -131,6 +151,16 @@ void Menu::init(int8_t resourceType)
                 _numEntries++;
             }
 
+            MenuEntryHdDats = -1;
+            if (resourceType == Resource::DT_20TH_EDITION)
+            {
+                _entries[_numEntries].name = "HD assets";
+                _entries[_numEntries].type = MenuEntryTypeBinary;
+                _entries[_numEntries].selectedBinary = false;
+                MenuEntryHdDats = _numEntries;
+                _numEntries++;
+            }
+
             MenuEntryAudio = -1;
             if (resourceType == Resource::DT_20TH_EDITION || resourceType == Resource::DT_15TH_EDITION)
             {            
@@ -149,6 +179,33 @@ void Menu::init(int8_t resourceType)
                 MenuEntryMusic = _numEntries;
                 _numEntries++;
             }
+
+            MenuEntryCache = -1;
+            if (resourceType == Resource::DT_20TH_EDITION || resourceType == Resource::DT_WIN31 || resourceType == Resource::DT_DOS || resourceType == Resource::DT_AMIGA || resourceType == Resource::DT_ATARI || resourceType == Resource::DT_ATARI_DEMO)
+            {
+                _entries[_numEntries].name = "Disk cache";
+                _entries[_numEntries].type = MenuEntryTypeOptions;
+                _entries[_numEntries].selectedOption = 0;
+                _entries[_numEntries].numOptions = 3;
+                _entries[_numEntries].options[0].name = "Off";
+                _entries[_numEntries].options[1].name = "On";
+                _entries[_numEntries].options[2].name = "Build now";
+                MenuEntryCache = _numEntries;
+                _numEntries++;
+            }
+
+            // same order as MIX_SETTINGS in main.cpp
+            _entries[_numEntries].name = "Audio output";
+            _entries[_numEntries].type = MenuEntryTypeOptions;
+            _entries[_numEntries].selectedOption = 0;
+            _entries[_numEntries].numOptions = 5;
+            _entries[_numEntries].options[0].name = "44100 Hz";
+            _entries[_numEntries].options[1].name = "44100 Hz, low latency";
+            _entries[_numEntries].options[2].name = "48000 Hz, low latency";
+            _entries[_numEntries].options[3].name = "32000 Hz, low latency";
+            _entries[_numEntries].options[4].name = "22050 Hz, low latency";
+            MenuEntryAudioOutput = _numEntries;
+            _numEntries++;
         }
     }
 
@@ -326,7 +383,7 @@ void Menu::draw()
                 }
             }
 
-            y += 16;
+            y += (_numEntries > 9) ? 14 : 16; // keep the rows above the prompt
         }
 
         if (_resourceType < 0)
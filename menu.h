@@ -58,7 +58,7 @@ struct Menu
 
     int8_t _resourceType;
 
-    int MenuEntryDataPath, MenuEntryLanguage, MenuEntryPart, MenuEntryRenderer, MenuEntryAudio, MenuEntryMusic, MenuEntryEGAPalette, MenuEntryDifficulty, MenuEntryDemoInputs;
+    int MenuEntryDataPath, MenuEntryLanguage, MenuEntryPart, MenuEntryRenderer, MenuEntryAudio, MenuEntryMusic, MenuEntryEGAPalette, MenuEntryDifficulty, MenuEntryDemoInputs, MenuEntryMusicLockstep, MenuEntryMusicPrerender, MenuEntryCache, MenuEntryAudioOutput, MenuEntryHdDats;
 
     Menu();
     ~Menu();
@@ -10,6 +10,8 @@
 #include <map>
 #include "aifcplayer.h"
 #include "mixer.h"
+#include "mixerchannel.h"
+#include "musicstreamer.h"
 #include "sfxplayer.h"
 #include "util.h"
 
@@ -22,104 +24,15 @@ enum {
 
 static const bool kAmigaStereoChannels = false; // 0,3:left 1,2:right
 
-static int16_t toS16(int a) {
-	return ((a << 8) | a) - 32768;
-}
-
-static int16_t mixS16(int sample1, int sample2) {
-	const int sample = sample1 + sample2;
-	return sample < -32768 ? -32768 : ((sample > 32767 ? 32767 : sample));
-}
-
-struct MixerChannel {
-	const uint8_t *_data;
-	Frac _pos;
-	uint32_t _len;
-	uint32_t _loopLen, _loopPos;
-	int _volume;
-	void (MixerChannel::*_mixWav)(int16_t *sample, int count);
-
-	void initRaw(const uint8_t *data, int freq, int volume, int mixingFreq) {
-		_data = data + 8;
-		_pos.reset(freq, mixingFreq);
-
-		const int len = READ_BE_UINT16(data) * 2;
-		_loopLen = READ_BE_UINT16(data + 2) * 2;
-		_loopPos = _loopLen ? len : 0;
-		_len = len;
-
-		_volume = volume;
-	}
-
-	void initWav(const uint8_t *data, int freq, int volume, int mixingFreq, int len, bool bits16, bool stereo, bool loop) {
-		_data = data;
-		_pos.reset(freq, mixingFreq);
-
-		_len = len;
-		_loopLen = loop ? len : 0;
-		_loopPos = 0;
-		_volume = volume;
-		_mixWav = bits16 ? (stereo ? &MixerChannel::mixWav<16, true> : &MixerChannel::mixWav<16, false>) : (stereo ? &MixerChannel::mixWav<8, true> : &MixerChannel::mixWav<8, false>);
-	}
-	void mixRaw(int16_t &sample) {
-		if (_data) {
-			uint32_t pos = _pos.getInt();
-			_pos.offset += _pos.inc;
-			if (_loopLen != 0) {
-				if (pos >= _loopPos + _loopLen) {
-					pos = _loopPos;
-					_pos.offset = (_loopPos << Frac::BITS) + _pos.inc;
-				}
-			} else {
-				if (pos >= _len) {
-					_data = 0;
-					return;
-				}
-			}
-			sample = mixS16(sample, toS16(_data[pos] ^ 0x80) * _volume / 64);
-		}
-	}
-
-	template<int bits, bool stereo>
-	void mixWav(int16_t *samples, int count) {
-		for (int i = 0; i < count; i += 2) {
-			uint32_t pos = _pos.getInt();
-			_pos.offset += _pos.inc;
-			if (pos >= _len) {
-				if (_loopLen != 0) {
-					pos = 0;
-					_pos.offset = _pos.inc;
-				} else {
-					_data = 0;
-					break;
-				}
-			}
-			if (stereo) {
-				pos *= 2;
-			}
-			int valueL;
-			if (bits == 8) { // U8
-				valueL = toS16(_data[pos]) * _volume / 64;
-			} else { // S16
-				valueL = ((int16_t)READ_LE_UINT16(&_data[pos * sizeof(int16_t)])) * _volume / 64;
-			}
-			*samples = mixS16(*samples, valueL);
-			++samples;
-
-			int valueR;
-			if (!stereo) {
-				valueR = valueL;
-			} else {
-				if (bits == 8) { // U8
-					valueR = toS16(_data[pos + 1]) * _volume / 64;
-				} else { // S16
-					valueR = ((int16_t)READ_LE_UINT16(&_data[(pos + 1) * sizeof(int16_t)])) * _volume / 64;
-				}
-			}
-			*samples = mixS16(*samples, valueR);
-			++samples;
-		}
-	}
+// raw sound converted to the mixing rate, the intro holds the first pass up
+// to the end of the loop and the loop is replayed from its first sample
+struct ResampledSound {
+	const uint8_t *data;
+	int freq;
+	int16_t *samples;
+	uint32_t introLen, loopLen;
+	uint32_t lastUse;
+	uint32_t releasePos; // command replacing the sound on its channel
 };
 
 static const uint8_t *loadWav(const uint8_t *data, int &freq, int &len, bool &bits16, bool &stereo) {
@@ -185,38 +98,122 @@ static const uint8_t *loadWav(const uint8_t *data, int &freq, int &len, bool &bi
 	return data + offset;
 }
 
+enum {
+	kMixerCmdPlayRaw,
+	kMixerCmdPlayWav,
+	kMixerCmdStop,
+	kMixerCmdSetVolume,
+	kMixerCmdPlaySfx,
+	kMixerCmdStopSfx,
+	kMixerCmdSetSfxDelay,
+	kMixerCmdSetSfxChannel,
+	kMixerCmdSetSfxVolume
+};
+
+struct MixerCommand {
+	uint8_t type;
+	uint8_t channel;
+	uint8_t volume;
+	bool loop;
+	bool bits16, stereo;
+	int freq;
+	int len;
+	const uint8_t *data;
+	const int16_t *samples; // kMixerCmdPlayRaw, resampled copy of data
+	int loopLen;
+	uint16_t delay; // kMixerCmdSetSfxDelay
+	SfxChannel sfxChannel; // kMixerCmdSetSfxChannel
+	int prerenderGen; // kMixerCmdPlaySfx
+	uint32_t timeStamp; // only used to count the late commands
+};
+
 struct Mixer_impl {
 
-	static const int kMixFreq = 44100;
 	static const SDL_AudioFormat kMixFormat = AUDIO_S16SYS;
 	static const int kMixSoundChannels = 2;
-	static const int kMixBufSize = 4096;
+	static const int kMixBufSize = 4096; // frames mixed per pass into _mixBuf
+	static const int kCallbackBuckets = 5; // quarters of the buffer duration, the last one is an overrun
 	static const int kMixChannels = 4;
+	static const int kCommandQueueSize = 64; // must be a power of 2
+	static const int kResampledSounds = 32;
+	static const uint32_t kResampledMaxSize = 1024 * 1024; // bytes
 
 	Mix_Chunk *_sounds[kMixChannels];
 	Mix_Music *_music;
+	MusicStreamer *_streamer;
 	MixerChannel _channels[kMixChannels];
+	int _mixFreq;
+	int _mixSamples; // frames per audio callback
+	int32_t _mixBuf[kMixBufSize * kMixSoundChannels];
 	SfxPlayer *_sfx;
 	std::map<int, Mix_Chunk *> _preloads; // AIFF preloads (3DO)
 
-	void init(MixerType mixerType) {
+	// single producer (game thread), single consumer (audio callback)
+	bool _useCommandQueue;
+	MixerCommand _commands[kCommandQueueSize];
+	SDL_atomic_t _commandsRead, _commandsWrite;
+	int _commandsMaxDepth, _commandsLate, _commandsOverflow;
+
+	// raw sounds resampled to _mixFreq, filled by the game thread
+	ResampledSound _resampledSounds[kResampledSounds];
+	ResampledSound *_channelSounds[kMixChannels]; // last sound pushed to the channel
+	uint32_t _resampledSize;
+	uint32_t _resampledCounter;
+	int _resampledHits, _resampledMisses, _resampledEvictions;
+
+	// audio callback timings, written by the callback
+	uint64_t _callbackCounter;
+	uint32_t _callbackHistogram[kCallbackBuckets];
+	uint32_t _callbackMaxUs;
+	uint32_t _underruns;
+
+	void init(MixerType mixerType, int mixFreq, int mixSamples) {
 		memset(_sounds, 0, sizeof(_sounds));
 		_music = 0;
+		_streamer = 0;
 		memset(_channels, 0, sizeof(_channels));
 		for (int i = 0; i < kMixChannels; ++i) {
 			_channels[i]._mixWav = &MixerChannel::mixWav<8, false>;
 		}
 		_sfx = 0;
-
+		_useCommandQueue = (mixerType != kMixerTypeAiff);
+		SDL_AtomicSet(&_commandsRead, 0);
+		SDL_AtomicSet(&_commandsWrite, 0);
+		_commandsMaxDepth = _commandsLate = _commandsOverflow = 0;
+		memset(_resampledSounds, 0, sizeof(_resampledSounds));
+		memset(_channelSounds, 0, sizeof(_channelSounds));
+		_resampledSize = 0;
+		_resampledCounter = 0;
+		_resampledHits = _resampledMisses = _resampledEvictions = 0;
+		_callbackCounter = 0;
+		memset(_callbackHistogram, 0, sizeof(_callbackHistogram));
+		_callbackMaxUs = 0;
+		_underruns = 0;
+
+		_mixFreq = mixFreq;
+		_mixSamples = mixSamples;
 		Mix_Init(MIX_INIT_OGG | MIX_INIT_FLUIDSYNTH);
-		if (Mix_OpenAudio(kMixFreq, kMixFormat, kMixSoundChannels, kMixBufSize) < 0) {
+		if (Mix_OpenAudio(_mixFreq, kMixFormat, kMixSoundChannels, _mixSamples) < 0) {
 			warning("Mix_OpenAudio failed: %s", Mix_GetError());
+		} else {
+			int freq, channels;
+			Uint16 format;
+			if (Mix_QuerySpec(&freq, &format, &channels) && freq != _mixFreq) {
+				warning("Mixer rate %d not available, using %d", _mixFreq, freq);
+				_mixFreq = freq;
+			}
 		}
+		debug(DBG_SND, "Mixer rate %d buffer %d frames (%d ms)", _mixFreq, _mixSamples, _mixSamples * 1000 / _mixFreq);
 		switch (mixerType) {
 		case kMixerTypeRaw:
 			Mix_HookMusic(mixAudio, this);
 			break;
 		case kMixerTypeWav:
+			_streamer = new MusicStreamer;
+			if (!_streamer->init(_mixFreq)) {
+				delete _streamer;
+				_streamer = 0;
+			}
 			Mix_SetPostMix(mixAudioWav, this);
 			break;
 		case kMixerTypeAiff:
@@ -226,6 +223,11 @@ struct Mixer_impl {
 	}
 	void quit() {
 		stopAll();
+		debug(DBG_SND, "Mixer commands max depth %d late %d overflow %d", _commandsMaxDepth, _commandsLate, _commandsOverflow);
+		debug(DBG_SND, "Mixer resampled sounds hits %d misses %d evictions %d", _resampledHits, _resampledMisses, _resampledEvictions);
+		debug(DBG_SND, "Mixer callback duration (buffer quarters) %d %d %d %d overrun %d, max %d us, underruns %d", _callbackHistogram[0], _callbackHistogram[1], _callbackHistogram[2], _callbackHistogram[3], _callbackHistogram[4], _callbackMaxUs, _underruns);
+		delete _streamer;
+		_streamer = 0;
 		Mix_CloseAudio();
 		Mix_Quit();
 	}
@@ -238,11 +240,223 @@ struct Mixer_impl {
 		}
 	}
 
-	void playSoundRaw(uint8_t channel, const uint8_t *data, int freq, uint8_t volume) {
+	void executeCommand(const MixerCommand &cmd) {
+		switch (cmd.type) {
+		case kMixerCmdPlayRaw:
+			if (cmd.samples) {
+				_channels[cmd.channel].initResampled(cmd.data, cmd.samples, cmd.len, cmd.loopLen, cmd.volume);
+			} else {
+				_channels[cmd.channel].initRaw(cmd.data, cmd.freq, cmd.volume, _mixFreq);
+			}
+			break;
+		case kMixerCmdPlayWav:
+			_channels[cmd.channel].initWav(cmd.data, cmd.freq, cmd.volume, _mixFreq, cmd.len, cmd.bits16, cmd.stereo, cmd.loop);
+			break;
+		case kMixerCmdStop:
+			_channels[cmd.channel]._data = 0;
+			break;
+		case kMixerCmdSetVolume:
+			_channels[cmd.channel]._volume = cmd.volume;
+			break;
+		case kMixerCmdPlaySfx:
+			_sfx = (SfxPlayer *)cmd.data;
+			_sfx->play(_mixFreq);
+			_sfx->resetPrerender(cmd.prerenderGen);
+			break;
+		case kMixerCmdStopSfx:
+			if (_sfx) {
+				_sfx->stop();
+				_sfx = 0;
+			}
+			break;
+		case kMixerCmdSetSfxDelay:
+			((SfxPlayer *)cmd.data)->setEventsDelay(cmd.delay);
+			break;
+		case kMixerCmdSetSfxChannel:
+			((SfxPlayer *)cmd.data)->_channels[cmd.channel] = cmd.sfxChannel;
+			break;
+		case kMixerCmdSetSfxVolume:
+			((SfxPlayer *)cmd.data)->_channels[cmd.channel].volume = cmd.volume;
+			break;
+		}
+	}
+	void pushCommand(MixerCommand &cmd) {
+		cmd.timeStamp = SDL_GetTicks();
+		if (_useCommandQueue) {
+			const uint32_t readPos = SDL_AtomicGet(&_commandsRead);
+			const uint32_t writePos = SDL_AtomicGet(&_commandsWrite);
+			const int depth = writePos - readPos;
+			if (depth < kCommandQueueSize) {
+				_commands[writePos & (kCommandQueueSize - 1)] = cmd;
+				SDL_MemoryBarrierRelease();
+				SDL_AtomicSet(&_commandsWrite, writePos + 1);
+				if (depth + 1 > _commandsMaxDepth) {
+					_commandsMaxDepth = depth + 1;
+				}
+				return;
+			}
+			++_commandsOverflow;
+		}
+		// no audio callback to drain the queue, or the queue is full
 		SDL_LockAudio();
-		_channels[channel].initRaw(data, freq, volume, kMixFreq);
+		drainCommands();
+		executeCommand(cmd);
 		SDL_UnlockAudio();
 	}
+	// called at the start of each mixed block, the commands take effect at block
+	// granularity (up to _mixSamples frames after being pushed), not at a sample offset
+	void drainCommands() {
+		uint32_t readPos = SDL_AtomicGet(&_commandsRead);
+		const uint32_t writePos = SDL_AtomicGet(&_commandsWrite);
+		SDL_MemoryBarrierAcquire();
+		if (readPos == writePos) {
+			return;
+		}
+		const uint32_t now = SDL_GetTicks();
+		for (; readPos != writePos; ++readPos) {
+			const MixerCommand &cmd = _commands[readPos & (kCommandQueueSize - 1)];
+			if (now - cmd.timeStamp > (uint32_t)(_mixSamples * 1000 / _mixFreq)) {
+				++_commandsLate;
+			}
+			executeCommand(cmd);
+		}
+		SDL_AtomicSet(&_commandsRead, readPos);
+	}
+	uint32_t getCommandPosition() {
+		return SDL_AtomicGet(&_commandsWrite);
+	}
+	bool isCommandDrained(uint32_t pos) {
+		if (!_useCommandQueue) {
+			return true; // executed by pushCommand
+		}
+		return (int32_t)(SDL_AtomicGet(&_commandsRead) - pos) >= 0;
+	}
+
+	// the callback lets go of a sound once it has drained the command replacing it
+	void setChannelSound(uint8_t channel, ResampledSound *rs) {
+		ResampledSound *prev = _channelSounds[channel];
+		if (prev && prev != rs) {
+			prev->releasePos = getCommandPosition();
+		}
+		_channelSounds[channel] = rs;
+	}
+	bool isResampledSoundInUse(const ResampledSound *rs) {
+		for (int i = 0; i < kMixChannels; ++i) {
+			if (_channelSounds[i] == rs) {
+				return true;
+			}
+		}
+		return !isCommandDrained(rs->releasePos);
+	}
+	void freeResampledSound(ResampledSound *rs) {
+		_resampledSize -= (rs->introLen + rs->loopLen) * sizeof(int16_t);
+		free(rs->samples);
+		memset(rs, 0, sizeof(ResampledSound));
+	}
+	// returns a free slot, releasing the least recently used sounds until 'size' bytes fit
+	ResampledSound *allocResampledSound(uint32_t size) {
+		ResampledSound *slot = 0;
+		while (1) {
+			ResampledSound *lru = 0;
+			slot = 0;
+			for (int i = 0; i < kResampledSounds; ++i) {
+				ResampledSound *rs = &_resampledSounds[i];
+				if (!rs->samples) {
+					slot = rs;
+				} else if (!isResampledSoundInUse(rs) && (!lru || rs->lastUse < lru->lastUse)) {
+					lru = rs;
+				}
+			}
+			if (slot && _resampledSize + size <= kResampledMaxSize) {
+				break;
+			}
+			if (!lru) {
+				slot = 0;
+				break;
+			}
+			freeResampledSound(lru);
+			++_resampledEvictions;
+		}
+		return slot;
+	}
+	ResampledSound *getResampledSound(const uint8_t *data, int freq) {
+		for (int i = 0; i < kResampledSounds; ++i) {
+			ResampledSound *rs = &_resampledSounds[i];
+			if (rs->samples && rs->data == data && rs->freq == freq) {
+				rs->lastUse = ++_resampledCounter;
+				++_resampledHits;
+				return rs;
+			}
+		}
+		++_resampledMisses;
+		Frac pos;
+		pos.reset(freq, _mixFreq);
+		const uint32_t inc = pos.inc;
+		if (inc == 0) {
+			return 0;
+		}
+		const uint32_t len = READ_BE_UINT16(data) * 2;
+		const uint32_t loopLen = READ_BE_UINT16(data + 2) * 2;
+		const uint32_t loopPos = loopLen ? len : 0;
+		// same sample positions as MixerChannel::mixRaw
+		const uint64_t endOffset = ((uint64_t)(loopLen != 0 ? loopPos + loopLen : len)) << Frac::BITS;
+		const uint32_t introCount = (uint32_t)((endOffset + inc - 1) / inc);
+		const uint32_t loopCount = (uint32_t)(((((uint64_t)loopLen) << Frac::BITS) + inc - 1) / inc);
+		const uint32_t size = (introCount + loopCount) * sizeof(int16_t);
+		if (size == 0 || size > kResampledMaxSize / 4) {
+			return 0;
+		}
+		ResampledSound *rs = allocResampledSound(size);
+		if (!rs) {
+			return 0;
+		}
+		int16_t *samples = (int16_t *)malloc(size);
+		if (!samples) {
+			warning("Failed to allocate %d bytes (resampled sound)", size);
+			return 0;
+		}
+		const uint8_t *src = data + 8;
+		for (uint32_t i = 0; i < introCount; ++i) {
+			samples[i] = MixerChannel::toS16(src[(((uint64_t)i) * inc) >> Frac::BITS] ^ 0x80);
+		}
+		for (uint32_t i = 0; i < loopCount; ++i) {
+			samples[introCount + i] = MixerChannel::toS16(src[loopPos + ((((uint64_t)i) * inc) >> Frac::BITS)] ^ 0x80);
+		}
+		rs->data = data;
+		rs->freq = freq;
+		rs->samples = samples;
+		rs->introLen = introCount;
+		rs->loopLen = loopCount;
+		rs->lastUse = ++_resampledCounter;
+		_resampledSize += size;
+		debug(DBG_SND, "Resampled sound %p freq %d, %d bytes (total %d)", data, freq, size, _resampledSize);
+		return rs;
+	}
+	void flushResampledSounds() {
+		for (int i = 0; i < kResampledSounds; ++i) {
+			if (_resampledSounds[i].samples) {
+				freeResampledSound(&_resampledSounds[i]);
+			}
+		}
+	}
+
+	void playSoundRaw(uint8_t channel, const uint8_t *data, int freq, uint8_t volume) {
+		MixerCommand cmd;
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.type = kMixerCmdPlayRaw;
+		cmd.channel = channel;
+		cmd.data = data;
+		cmd.freq = freq;
+		cmd.volume = volume;
+		ResampledSound *rs = getResampledSound(data, freq);
+		if (rs) {
+			cmd.samples = rs->samples;
+			cmd.len = rs->introLen;
+			cmd.loopLen = rs->loopLen;
+		}
+		pushCommand(cmd);
+		setChannelSound(channel, rs);
+	}
 	void playSoundWav(uint8_t channel, const uint8_t *data, int freq, uint8_t volume, bool loop) {
 		int wavFreq, len;
 		bool bits16, stereo;
@@ -253,9 +467,18 @@ struct Mixer_impl {
 			freq = (int)(freq * (wavFreq / 9943.0f));
 		}
 
-		SDL_LockAudio();
-		_channels[channel].initWav(wavData, freq, volume, kMixFreq, len, bits16, stereo, loop);
-		SDL_UnlockAudio();
+		MixerCommand cmd;
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.type = kMixerCmdPlayWav;
+		cmd.channel = channel;
+		cmd.data = wavData;
+		cmd.freq = freq;
+		cmd.volume = volume;
+		cmd.len = len;
+		cmd.bits16 = bits16;
+		cmd.stereo = stereo;
+		cmd.loop = loop;
+		pushCommand(cmd);
 	}
 	void playSound(uint8_t channel, int volume, Mix_Chunk *chunk, int loops = 0) {
 		stopSound(channel);
@@ -266,9 +489,12 @@ struct Mixer_impl {
 		_sounds[channel] = chunk;
 	}
 	void stopSound(uint8_t channel) {
-		SDL_LockAudio();
-		_channels[channel]._data = 0;
-		SDL_UnlockAudio();
+		MixerCommand cmd;
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.type = kMixerCmdStop;
+		cmd.channel = channel;
+		pushCommand(cmd);
+		setChannelSound(channel, 0);
 		Mix_HaltChannel(channel);
 		freeSound(channel);
 	}
@@ -277,14 +503,26 @@ struct Mixer_impl {
 		_sounds[channel] = 0;
 	}
 	void setChannelVolume(uint8_t channel, uint8_t volume) {
-		SDL_LockAudio();
-		_channels[channel]._volume = volume;
-		SDL_UnlockAudio();
+		MixerCommand cmd;
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.type = kMixerCmdSetVolume;
+		cmd.channel = channel;
+		cmd.volume = volume;
+		pushCommand(cmd);
 		Mix_Volume(channel, volume * MIX_MAX_VOLUME / 63);
 	}
 
+	static bool isOggFile(const char *path) {
+		const char *ext = strrchr(path, '.');
+		return ext && strcasecmp(ext, ".ogg") == 0;
+	}
+
 	void playMusic(const char *path, int loops = 0) {
 		stopMusic();
+		if (_streamer && isOggFile(path)) {
+			_streamer->play(path, loops != 0);
+			return;
+		}
 		_music = Mix_LoadMUS(path);
 		if (_music) {
 			Mix_VolumeMusic(MIX_MAX_VOLUME / 2);
@@ -294,6 +532,9 @@ struct Mixer_impl {
 		}
 	}
 	void stopMusic() {
+		if (_streamer) {
+			_streamer->stop();
+		}
 		Mix_HaltMusic();
 		Mix_FreeMusic(_music);
 		_music = 0;
@@ -309,51 +550,107 @@ struct Mixer_impl {
 		Mix_HookMusic(0, 0);
 	}
 
-	void playSfxMusic(SfxPlayer *sfx) {
-		SDL_LockAudio();
-		_sfx = sfx;
-		_sfx->play(kMixFreq);
-		SDL_UnlockAudio();
+	void playSfxMusic(SfxPlayer *sfx, int prerenderGen) {
+		MixerCommand cmd;
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.type = kMixerCmdPlaySfx;
+		cmd.data = (const uint8_t *)sfx;
+		cmd.prerenderGen = prerenderGen;
+		pushCommand(cmd);
 	}
 	void stopSfxMusic() {
-		SDL_LockAudio();
-		if (_sfx) {
-			_sfx->stop();
-			_sfx = 0;
+		MixerCommand cmd;
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.type = kMixerCmdStopSfx;
+		pushCommand(cmd);
+	}
+	void setSfxMusicDelay(SfxPlayer *sfx, uint16_t delay) {
+		MixerCommand cmd;
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.type = kMixerCmdSetSfxDelay;
+		cmd.data = (const uint8_t *)sfx;
+		cmd.delay = delay;
+		pushCommand(cmd);
+	}
+	// channels changed by the lockstep sequencer
+	void setSfxChannels(SfxPlayer *sfx, const SfxPlayer *state) {
+		for (int i = 0; i < SfxPlayer::NUM_CHANNELS; ++i) {
+			MixerCommand cmd;
+			memset(&cmd, 0, sizeof(cmd));
+			cmd.data = (const uint8_t *)sfx;
+			cmd.channel = i;
+			if (state->_channelsChanged & (1 << i)) {
+				cmd.type = kMixerCmdSetSfxChannel;
+				cmd.sfxChannel = state->_channels[i];
+			} else if (state->_channelsVolume & (1 << i)) {
+				cmd.type = kMixerCmdSetSfxVolume;
+				cmd.volume = state->_channels[i].volume;
+			} else {
+				continue;
+			}
+			pushCommand(cmd);
 		}
-		SDL_UnlockAudio();
 	}
 
-	void mixChannels(int16_t *samples, int count) {
+	void mixChannels(int32_t *samples, int count) {
 		if (kAmigaStereoChannels) {
-			for (int i = 0; i < count; i += 2) {
-				_channels[0].mixRaw(*samples);
-				_channels[3].mixRaw(*samples);
-				++samples;
-				_channels[1].mixRaw(*samples);
-				_channels[2].mixRaw(*samples);
-				++samples;
-			}
+			_channels[0].mixRaw(samples, count / 2, 2);
+			_channels[3].mixRaw(samples, count / 2, 2);
+			_channels[1].mixRaw(samples + 1, count / 2, 2);
+			_channels[2].mixRaw(samples + 1, count / 2, 2);
 		}  else {
+			for (int j = 0; j < kMixChannels; ++j) {
+				_channels[j].mixRaw(samples, count / 2, 2);
+			}
 			for (int i = 0; i < count; i += 2) {
-				for (int j = 0; j < kMixChannels; ++j) {
-					_channels[j].mixRaw(samples[i]);
-				}
 				samples[i + 1] = samples[i];
 			}
 		}
 	}
 
+	void beginCallback(uint64_t &counter) {
+		counter = SDL_GetPerformanceCounter();
+		// the device went without data if the previous callback is further away than two buffers
+		if (_callbackCounter != 0 && (counter - _callbackCounter) * _mixFreq > 2 * (uint64_t)_mixSamples * SDL_GetPerformanceFrequency()) {
+			++_underruns;
+		}
+		_callbackCounter = counter;
+	}
+	void endCallback(uint64_t counter) {
+		const uint32_t us = (uint32_t)((SDL_GetPerformanceCounter() - counter) * 1000000 / SDL_GetPerformanceFrequency());
+		const uint32_t bufferUs = (uint32_t)((uint64_t)_mixSamples * 1000000 / _mixFreq);
+		int bucket = us * (kCallbackBuckets - 1) / bufferUs;
+		if (bucket >= kCallbackBuckets) {
+			bucket = kCallbackBuckets - 1;
+		}
+		++_callbackHistogram[bucket];
+		if (us > _callbackMaxUs) {
+			_callbackMaxUs = us;
+		}
+	}
+
 	static void mixAudio(void *data, uint8_t *s16buf, int len) {
-		memset(s16buf, 0, len);
 		Mixer_impl *mixer = (Mixer_impl *)data;
-		mixer->mixChannels((int16_t *)s16buf, len / sizeof(int16_t));
-		if (mixer->_sfx) {
-			mixer->_sfx->readSamples((int16_t *)s16buf, len / sizeof(int16_t));
+		uint64_t counter;
+		mixer->beginCallback(counter);
+		mixer->drainCommands();
+		int16_t *samples = (int16_t *)s16buf;
+		int count = len / sizeof(int16_t);
+		while (count > 0) {
+			const int n = (count < kMixBufSize * kMixSoundChannels) ? count : kMixBufSize * kMixSoundChannels;
+			memset(mixer->_mixBuf, 0, n * sizeof(int32_t));
+			mixer->mixChannels(mixer->_mixBuf, n);
+			if (mixer->_sfx) {
+				mixer->_sfx->readSamples(mixer->_mixBuf, n);
+			}
+			saturateS16(mixer->_mixBuf, samples, n);
+			samples += n;
+			count -= n;
 		}
+		mixer->endCallback(counter);
 	}
 
-	void mixChannelsWav(int16_t *samples, int count) {
+	void mixChannelsWav(int32_t *samples, int count) {
 		for (int i = 0; i < kMixChannels; ++i) {
 			if (_channels[i]._data) {
 				(_channels[i].*_channels[i]._mixWav)(samples, count);
@@ -363,7 +660,25 @@ struct Mixer_impl {
 
 	static void mixAudioWav(void *data, uint8_t *s16buf, int len) {
 		Mixer_impl *mixer = (Mixer_impl *)data;
-		mixer->mixChannelsWav((int16_t *)s16buf, len / sizeof(int16_t));
+		uint64_t counter;
+		mixer->beginCallback(counter);
+		mixer->drainCommands();
+		int16_t *samples = (int16_t *)s16buf;
+		int count = len / sizeof(int16_t);
+		while (count > 0) {
+			const int n = (count < kMixBufSize * kMixSoundChannels) ? count : kMixBufSize * kMixSoundChannels;
+			for (int i = 0; i < n; ++i) {
+				mixer->_mixBuf[i] = samples[i];
+			}
+			mixer->mixChannelsWav(mixer->_mixBuf, n);
+			if (mixer->_streamer) {
+				mixer->_streamer->readSamples(mixer->_mixBuf, n);
+			}
+			saturateS16(mixer->_mixBuf, samples, n);
+			samples += n;
+			count -= n;
+		}
+		mixer->endCallback(counter);
 	}
 
 	void stopAll() {
@@ -372,6 +687,11 @@ struct Mixer_impl {
 		}
 		stopMusic();
 		stopSfxMusic();
+		// the sound data can be released by the caller, wait for the callback to let go of it
+		SDL_LockAudio();
+		drainCommands();
+		SDL_UnlockAudio();
+		flushResampledSounds();
 		for (std::map<int, Mix_Chunk *>::iterator it = _preloads.begin(); it != _preloads.end(); ++it) {
 			debug(DBG_SND, "Flush preload %d", it->first);
 			Mix_FreeChunk(it->second);
@@ -407,7 +727,7 @@ Mixer::Mixer(SfxPlayer *sfx)
 
 void Mixer::init(MixerType mixerType) {
 	_impl = new Mixer_impl();
-	_impl->init(mixerType);
+	_impl->init(mixerType, _mixFreq, _mixSamples);
 }
 
 void Mixer::quit() {
@@ -453,6 +773,20 @@ void Mixer::setChannelVolume(uint8_t channel, uint8_t volume) {
 	}
 }
 
+uint32_t Mixer::getCommandPosition() {
+	if (_impl) {
+		return _impl->getCommandPosition();
+	}
+	return 0;
+}
+
+bool Mixer::isCommandDrained(uint32_t pos) {
+	if (_impl) {
+		return _impl->isCommandDrained(pos);
+	}
+	return true;
+}
+
 void Mixer::playMusic(const char *path, uint8_t loop) {
 	if (!_isMusicActive) return;
 	debug(DBG_SND, "Mixer::playMusic(%s, %d)", path, loop);
@@ -469,6 +803,12 @@ void Mixer::stopMusic() {
 	}
 }
 
+void Mixer::setMusicCacheDir(const char *dataDir) {
+	if (_impl && _impl->_streamer) {
+		_impl->_streamer->setCacheDir(dataDir);
+	}
+}
+
 void Mixer::playAifcMusic(const char *path, uint32_t offset) {
 	debug(DBG_SND, "Mixer::playAifcMusic(%s)", path);
 	if (!_aifc) {
@@ -476,7 +816,7 @@ void Mixer::playAifcMusic(const char *path, uint32_t offset) {
 	}
 	if (_impl) {
 		_impl->stopAifcMusic();
-		if (_aifc->play(Mixer_impl::kMixFreq, path, offset)) {
+		if (_aifc->play(_impl->_mixFreq, path, offset)) {
 			_impl->playAifcMusic(_aifc);
 		}
 	}
@@ -493,19 +833,49 @@ void Mixer::stopAifcMusic() {
 void Mixer::playSfxMusic(int num) {
 	debug(DBG_SND, "Mixer::playSfxMusic(%d)", num);
 	if (_impl && _sfx) {
-		return _impl->playSfxMusic(_sfx);
+		const int prerenderGen = _sfx->startPrerender(_impl->_mixFreq);
+		_sfx->startLockstep(_impl->_mixFreq);
+		return _impl->playSfxMusic(_sfx, prerenderGen);
 	}
 }
 
 void Mixer::stopSfxMusic() {
 	debug(DBG_SND, "Mixer::stopSfxMusic()");
 	if (_impl && _sfx) {
+		_sfx->stopPrerender();
+		_sfx->stopLockstep();
 		return _impl->stopSfxMusic();
 	}
 }
 
+void Mixer::setSfxMusicDelay(uint16_t delay) {
+	debug(DBG_SND, "Mixer::setSfxMusicDelay(%d)", delay);
+	if (_sfx) {
+		// the samples rendered ahead used the previous tempo
+		_sfx->stopPrerender();
+		if (_sfx->_lockstepState) {
+			_sfx->_lockstepState->setEventsDelay(delay);
+		}
+		if (_impl) {
+			return _impl->setSfxMusicDelay(_sfx, delay);
+		}
+		_sfx->setEventsDelay(delay);
+	}
+}
+
+void Mixer::advanceSfxMusic(int ms) {
+	if (_impl && _sfx && _sfx->_lockstepState) {
+		_sfx->_lockstepState->advanceLockstep(ms);
+		_impl->setSfxChannels(_sfx, _sfx->_lockstepState);
+	}
+}
+
 void Mixer::stopAll() {
 	debug(DBG_SND, "Mixer::stopAll()");
+	if (_sfx) {
+		_sfx->stopPrerender();
+		_sfx->stopLockstep();
+	}
 	if (_impl) {
 		return _impl->stopAll();
 	}
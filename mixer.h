@@ -25,6 +25,8 @@ struct Mixer {
 	Mixer_impl *_impl;
 
 	static bool _isMusicActive;
+	static int _mixFreq;
+	static int _mixSamples; // frames per audio callback
 
 	Mixer(SfxPlayer *sfx);
 	void init(MixerType mixerType);
@@ -35,12 +37,19 @@ struct Mixer {
 	void playSoundWav(uint8_t channel, const uint8_t *data, uint16_t freq, uint8_t volume, uint8_t loop);
 	void stopSound(uint8_t channel);
 	void setChannelVolume(uint8_t channel, uint8_t volume);
+	// number of commands pushed so far, once the commands before 'pos' are drained
+	// the audio callback no longer reads the sound data they replaced
+	uint32_t getCommandPosition();
+	bool isCommandDrained(uint32_t pos);
 	void playMusic(const char *path, uint8_t loop);
 	void stopMusic();
+	void setMusicCacheDir(const char *dataDir);
 	void playAifcMusic(const char *path, uint32_t offset);
 	void stopAifcMusic();
 	void playSfxMusic(int num);
 	void stopSfxMusic();
+	void setSfxMusicDelay(uint16_t delay);
+	void advanceSfxMusic(int ms); // lockstep mode, called between frames
 	void stopAll();
 	void preloadSoundAiff(uint8_t num, const uint8_t *data);
 	void playSoundAiff(uint8_t channel, uint8_t num, uint8_t volume);
@@ -0,0 +1,244 @@
+#ifndef MIXER_CHANNEL_H__
+#define MIXER_CHANNEL_H__
+
+#include "intern.h"
+
+// Channels of the audio callback. They add whole blocks to a 32 bits
+// accumulator, saturated once by the caller. There is no SDL code here, the
+// host check in tools/ compares them with the per-sample mixers they replaced.
+
+inline void saturateS16(const int32_t *src, int16_t *dst, int count) {
+	for (int i = 0; i < count; ++i) {
+		const int sample = src[i];
+		dst[i] = sample < -32768 ? -32768 : ((sample > 32767 ? 32767 : sample));
+	}
+}
+
+struct MixerChannel {
+	const uint8_t *_data;
+	Frac _pos;
+	uint32_t _len;
+	uint32_t _loopLen, _loopPos;
+	int _volume;
+	void (MixerChannel::*_mixWav)(int32_t *samples, int count);
+	const int16_t *_resampled;
+	uint32_t _resampledPos;
+
+	static int16_t toS16(int a) {
+		return ((a << 8) | a) - 32768;
+	}
+
+	void initRaw(const uint8_t *data, int freq, int volume, int mixingFreq) {
+		_data = data + 8;
+		_pos.reset(freq, mixingFreq);
+
+		const int len = READ_BE_UINT16(data) * 2;
+		_loopLen = READ_BE_UINT16(data + 2) * 2;
+		_loopPos = _loopLen ? len : 0;
+		_len = len;
+
+		_volume = volume;
+		_resampled = 0;
+	}
+
+	void initResampled(const uint8_t *data, const int16_t *samples, uint32_t introLen, uint32_t loopLen, int volume) {
+		_data = data;
+		_resampled = samples;
+		_resampledPos = 0;
+		_len = introLen;
+		_loopLen = loopLen;
+		_volume = volume;
+	}
+
+	void initWav(const uint8_t *data, int freq, int volume, int mixingFreq, int len, bool bits16, bool stereo, bool loop) {
+		_data = data;
+		_pos.reset(freq, mixingFreq);
+
+		_len = len;
+		_loopLen = loop ? len : 0;
+		_loopPos = 0;
+		_volume = volume;
+		_mixWav = bits16 ? (stereo ? &MixerChannel::mixWav<16, true> : &MixerChannel::mixWav<16, false>) : (stereo ? &MixerChannel::mixWav<8, true> : &MixerChannel::mixWav<8, false>);
+	}
+	// channels render whole blocks into a 32 bits accumulator, saturated once by the caller
+	void mixRaw(int32_t *samples, int count, int stride) {
+		if (!_data) {
+			return;
+		}
+		if (_resampled) {
+			mixResampled(samples, count, stride);
+			return;
+		}
+		const uint32_t inc = _pos.inc;
+		uint64_t offset = _pos.offset;
+		const uint64_t endOffset = ((uint64_t)(_loopLen != 0 ? _loopPos + _loopLen : _len)) << Frac::BITS;
+		while (count > 0) {
+			if (offset >= endOffset) {
+				if (_loopLen == 0) {
+					_data = 0;
+					break;
+				}
+				offset = ((uint64_t)_loopPos) << Frac::BITS;
+			}
+			// number of steps before reaching the end of the sample (or loop)
+			int run = (inc != 0) ? (int)((endOffset - offset + inc - 1) / inc) : count;
+			if (run > count) {
+				run = count;
+			}
+			count -= run;
+			for (; run != 0; --run) {
+				*samples += toS16(_data[offset >> Frac::BITS] ^ 0x80) * _volume / 64;
+				offset += inc;
+				samples += stride;
+			}
+		}
+		_pos.offset = offset;
+	}
+
+	void mixResampled(int32_t *samples, int count, int stride) {
+		const uint32_t end = _len + _loopLen;
+		uint32_t pos = _resampledPos;
+		while (count > 0) {
+			if (pos >= end) {
+				if (_loopLen == 0) {
+					_data = 0;
+					break;
+				}
+				pos = _len;
+			}
+			int run = end - pos;
+			if (run > count) {
+				run = count;
+			}
+			count -= run;
+			for (; run != 0; --run) {
+				*samples += _resampled[pos++] * _volume / 64;
+				samples += stride;
+			}
+		}
+		_resampledPos = pos;
+	}
+
+	template<int bits, bool stereo>
+	void mixWav(int32_t *samples, int count) {
+		const uint32_t inc = _pos.inc;
+		uint64_t offset = _pos.offset;
+		const uint64_t endOffset = ((uint64_t)_len) << Frac::BITS;
+		count /= 2;
+		while (count > 0) {
+			if (offset >= endOffset) {
+				if (_loopLen == 0 || _len == 0) {
+					_data = 0;
+					break;
+				}
+				offset = 0;
+			}
+			int run = (inc != 0) ? (int)((endOffset - offset + inc - 1) / inc) : count;
+			if (run > count) {
+				run = count;
+			}
+			count -= run;
+			for (; run != 0; --run) {
+				uint32_t pos = offset >> Frac::BITS;
+				offset += inc;
+				if (stereo) {
+					pos *= 2;
+				}
+				int valueL;
+				if (bits == 8) { // U8
+					valueL = toS16(_data[pos]) * _volume / 64;
+				} else { // S16
+					valueL = ((int16_t)READ_LE_UINT16(&_data[pos * sizeof(int16_t)])) * _volume / 64;
+				}
+				int valueR;
+				if (!stereo) {
+					valueR = valueL;
+				} else {
+					if (bits == 8) { // U8
+						valueR = toS16(_data[pos + 1]) * _volume / 64;
+					} else { // S16
+						valueR = ((int16_t)READ_LE_UINT16(&_data[(pos + 1) * sizeof(int16_t)])) * _volume / 64;
+					}
+				}
+				samples[0] += valueL;
+				samples[1] += valueR;
+				samples += 2;
+			}
+		}
+		_pos.offset = offset;
+	}
+};
+
+// channel of the classic music modules, stereo buffers with the channel samples every other frame
+struct SfxChannel {
+	uint8_t *sampleData;
+	uint16_t sampleLen;
+	uint16_t sampleLoopPos;
+	uint16_t sampleLoopLen;
+	uint16_t volume;
+	Frac pos;
+
+	static int16_t toS16(int a) {
+		if (a <= -128) {
+			return -32768;
+		} else if (a >= 127) {
+			return 32767;
+		} else {
+			const uint8_t u8 = (a ^ 0x80);
+			return ((u8 << 8) | u8) - 32768;
+		}
+	}
+
+	// with mix == false, only the channel position is updated
+	template<bool mix>
+	void mixSamples(int32_t *samples, int count) {
+		if (sampleLen == 0) {
+			return;
+		}
+		const int8_t *data = (const int8_t *)sampleData;
+		const uint32_t inc = pos.inc;
+		uint64_t offset = pos.offset;
+		const uint32_t last = (sampleLoopLen != 0) ? sampleLoopPos + sampleLoopLen - 1 : sampleLen - 1;
+		while (count > 0) {
+			const uint32_t pos1 = offset >> Frac::BITS;
+			if (pos1 >= last) {
+				if (sampleLoopLen == 0) {
+					sampleLen = 0;
+					return;
+				}
+				// interpolate with the loop start, the fractional part restarts at 0
+				const int pos2 = sampleLoopPos;
+				offset = ((uint64_t)pos2) << Frac::BITS;
+				if (mix) {
+					const int sample = (data[pos1] * Frac::MASK) >> Frac::BITS;
+					*samples += toS16(sample * volume / 64);
+				}
+				samples += 2;
+				--count;
+				continue;
+			}
+			// number of steps before reaching the last sample (or the end of the loop)
+			int run = (inc != 0) ? (int)(((((uint64_t)last) << Frac::BITS) - offset + inc - 1) / inc) : count;
+			if (run > count) {
+				run = count;
+			}
+			count -= run;
+			if (!mix) {
+				offset += ((uint64_t)run) * inc;
+				samples += run * 2;
+				continue;
+			}
+			for (; run != 0; --run) {
+				const uint32_t p = offset >> Frac::BITS;
+				offset += inc;
+				const int fp = offset & Frac::MASK;
+				const int sample = (data[p] * (Frac::MASK - fp) + data[p + 1] * fp) >> Frac::BITS;
+				*samples += toS16(sample * volume / 64);
+				samples += 2;
+			}
+		}
+		pos.offset = offset;
+	}
+};
+
+#endif
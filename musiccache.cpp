@@ -0,0 +1,374 @@
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <SDL.h>
+#include "musiccache.h"
+#include "util.h"
+
+static const uint32_t kCacheVersion = 1;
+
+bool OggMusicDecoder::open(const char *path) {
+	close();
+	if (ov_fopen(path, &_vf) != 0) {
+		return false;
+	}
+	_isOpen = true;
+	const vorbis_info *vi = ov_info(&_vf, -1);
+	_rate = vi->rate;
+	_channels = vi->channels;
+	if (_channels != 1 && _channels != 2) {
+		warning("Unsupported music channels %d '%s'", _channels, path);
+		close();
+		return false;
+	}
+	return true;
+}
+
+void OggMusicDecoder::close() {
+	if (_isOpen) {
+		ov_clear(&_vf);
+		_isOpen = false;
+	}
+}
+
+bool OggMusicDecoder::rewind() {
+	return ov_pcm_seek(&_vf, 0) == 0;
+}
+
+int OggMusicDecoder::read(int16_t *buf, int frames) {
+	while (1) {
+		int bitstream;
+		const long count = ov_read(&_vf, (char *)buf, frames * _channels * sizeof(int16_t), 0, 2, 1, &bitstream);
+		if (count == OV_HOLE) {
+			continue;
+		}
+		return (count < 0) ? count : count / (_channels * sizeof(int16_t));
+	}
+}
+
+static const int16_t _imaStepTable[89] = {
+	    7,     8,     9,    10,    11,    12,    13,    14,    16,    17,
+	   19,    21,    23,    25,    28,    31,    34,    37,    41,    45,
+	   50,    55,    60,    66,    73,    80,    88,    97,   107,   118,
+	  130,   143,   157,   173,   190,   209,   230,   253,   279,   307,
+	  337,   371,   408,   449,   494,   544,   598,   658,   724,   796,
+	  876,   963,  1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,
+	 2272,  2499,  2749,  3024,  3327,  3660,  4026,  4428,  4871,  5358,
+	 5894,  6484,  7132,  7845,  8630,  9493, 10442, 11487, 12635, 13899,
+	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t _imaIndexTable[16] = {
+	-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+int ImaAdpcmState::decode(int nibble) {
+	const int step = _imaStepTable[_index];
+	int diff = step >> 3;
+	if (nibble & 1) {
+		diff += step >> 2;
+	}
+	if (nibble & 2) {
+		diff += step >> 1;
+	}
+	if (nibble & 4) {
+		diff += step;
+	}
+	if (nibble & 8) {
+		_predictor -= diff;
+	} else {
+		_predictor += diff;
+	}
+	if (_predictor < -32768) {
+		_predictor = -32768;
+	} else if (_predictor > 32767) {
+		_predictor = 32767;
+	}
+	_index += _imaIndexTable[nibble];
+	if (_index < 0) {
+		_index = 0;
+	} else if (_index > 88) {
+		_index = 88;
+	}
+	return _predictor;
+}
+
+int ImaAdpcmState::encode(int sample) {
+	int step = _imaStepTable[_index];
+	int diff = sample - _predictor;
+	int nibble = 0;
+	if (diff < 0) {
+		nibble = 8;
+		diff = -diff;
+	}
+	if (diff >= step) {
+		nibble |= 4;
+		diff -= step;
+	}
+	step >>= 1;
+	if (diff >= step) {
+		nibble |= 2;
+		diff -= step;
+	}
+	step >>= 1;
+	if (diff >= step) {
+		nibble |= 1;
+	}
+	decode(nibble); // keep the encoder state in sync with the decoder
+	return nibble;
+}
+
+bool ImaMusicDecoder::open(const char *path) {
+	close();
+	if (!_f.open(path)) {
+		return false;
+	}
+	uint8_t hdr[kHeaderSize];
+	if (_f.read(hdr, kHeaderSize) != kHeaderSize || memcmp(hdr, "AWMI", 4) != 0 || READ_LE_UINT32(hdr + 4) != kCacheVersion) {
+		warning("Invalid music cache file '%s'", path);
+		close();
+		return false;
+	}
+	_rate = READ_LE_UINT32(hdr + 16);
+	_channels = READ_LE_UINT16(hdr + 20);
+	_totalFrames = READ_LE_UINT32(hdr + 24);
+	if ((_channels != 1 && _channels != 2) || READ_LE_UINT16(hdr + 22) != kBlockFrames) {
+		warning("Unsupported music cache file '%s'", path);
+		close();
+		return false;
+	}
+	return rewind();
+}
+
+void ImaMusicDecoder::close() {
+	_f.close();
+	_blockPos = _blockLen = 0;
+}
+
+bool ImaMusicDecoder::rewind() {
+	_f.seek(kHeaderSize);
+	_framesLeft = _totalFrames;
+	_blockPos = _blockLen = 0;
+	return true;
+}
+
+bool ImaMusicDecoder::readBlock() {
+	const int size = getBlockSize();
+	if (_f.read(_block, size) != size) {
+		return false;
+	}
+	for (int c = 0; c < _channels; ++c) {
+		_state[c]._predictor = (int16_t)READ_LE_UINT16(_block + c * kBlockHeaderSize);
+		_state[c]._index = _block[c * kBlockHeaderSize + 2];
+		if (_state[c]._index > 88) {
+			return false;
+		}
+	}
+	_blockPos = 0;
+	_blockLen = (_framesLeft < (uint32_t)kBlockFrames) ? _framesLeft : kBlockFrames;
+	return true;
+}
+
+int ImaMusicDecoder::read(int16_t *buf, int frames) {
+	if (_blockPos >= _blockLen) {
+		if (_framesLeft == 0) {
+			return 0;
+		}
+		if (!readBlock()) {
+			return -1;
+		}
+	}
+	int count = _blockLen - _blockPos;
+	if (count > frames) {
+		count = frames;
+	}
+	const uint8_t *data = _block + _channels * kBlockHeaderSize;
+	if (_channels == 2) {
+		for (int i = 0; i < count; ++i) {
+			const uint8_t b = data[_blockPos + i];
+			*buf++ = _state[0].decode(b & 15);
+			*buf++ = _state[1].decode(b >> 4);
+		}
+	} else {
+		for (int i = 0; i < count; ++i) {
+			const int pos = _blockPos + i;
+			const uint8_t b = data[pos >> 1];
+			*buf++ = _state[0].decode((pos & 1) ? (b >> 4) : (b & 15));
+		}
+	}
+	_blockPos += count;
+	_framesLeft -= count;
+	return count;
+}
+
+static bool getSourceStat(const char *srcPath, uint32_t *size, uint32_t *mtime) {
+	struct stat s;
+	if (stat(srcPath, &s) != 0) {
+		return false;
+	}
+	*size = s.st_size;
+	*mtime = s.st_mtime;
+	return true;
+}
+
+const char *MusicCache::getCachePath(const char *dataDir, const char *srcPath, char *buf, int bufSize) {
+	const int len = strlen(dataDir);
+	if (strncmp(srcPath, dataDir, len) != 0 || srcPath[len] != '/') {
+		return 0;
+	}
+	// game/OGG/original/intro.ogg is stored as cache/game_OGG_original_intro.ima
+	const int n = snprintf(buf, bufSize, "%s/cache/%s", dataDir, srcPath + len + 1);
+	if (n >= bufSize) {
+		return 0;
+	}
+	for (char *p = buf + len + 7; *p; ++p) {
+		if (*p == '/') {
+			*p = '_';
+		}
+	}
+	char *ext = strrchr(buf, '.');
+	if (!ext || (ext - buf) + 5 > bufSize) {
+		return 0;
+	}
+	strcpy(ext, ".ima");
+	return buf;
+}
+
+bool MusicCache::checkCacheFile(const char *cachePath, const char *srcPath) {
+	uint32_t srcSize, srcMtime;
+	if (!getSourceStat(srcPath, &srcSize, &srcMtime)) {
+		return false;
+	}
+	File f;
+	uint8_t hdr[ImaMusicDecoder::kHeaderSize];
+	if (!f.open(cachePath) || f.read(hdr, sizeof(hdr)) != (int)sizeof(hdr)) {
+		return false;
+	}
+	return memcmp(hdr, "AWMI", 4) == 0 && READ_LE_UINT32(hdr + 4) == kCacheVersion && READ_LE_UINT32(hdr + 8) == srcSize && READ_LE_UINT32(hdr + 12) == srcMtime;
+}
+
+bool MusicCache::convert(const char *srcPath, const char *cachePath) {
+	uint32_t srcSize, srcMtime;
+	if (!getSourceStat(srcPath, &srcSize, &srcMtime)) {
+		return false;
+	}
+	OggMusicDecoder ogg;
+	if (!ogg.open(srcPath)) {
+		warning("Failed to open music '%s'", srcPath);
+		return false;
+	}
+	File f;
+	if (!f.openForWriting(cachePath)) {
+		warning("Unable to create '%s'", cachePath);
+		return false;
+	}
+	const uint32_t startTicks = SDL_GetTicks();
+	uint8_t hdr[ImaMusicDecoder::kHeaderSize];
+	memset(hdr, 0, sizeof(hdr));
+	WRITE_LE_UINT32(hdr + 4, kCacheVersion);
+	WRITE_LE_UINT32(hdr + 8, srcSize);
+	WRITE_LE_UINT32(hdr + 12, srcMtime);
+	WRITE_LE_UINT32(hdr + 16, ogg._rate);
+	hdr[20] = ogg._channels;
+	hdr[22] = ImaMusicDecoder::kBlockFrames & 255; hdr[23] = ImaMusicDecoder::kBlockFrames >> 8;
+	f.write(hdr, sizeof(hdr)); // the tag and frames count are written once the track is encoded
+
+	const int channels = ogg._channels;
+	static int16_t pcm[ImaMusicDecoder::kBlockFrames * 2];
+	uint8_t block[2 * ImaMusicDecoder::kBlockHeaderSize + ImaMusicDecoder::kBlockFrames];
+	ImaAdpcmState state[2];
+	memset(state, 0, sizeof(state));
+	uint32_t totalFrames = 0;
+	bool eof = false;
+	while (!eof) {
+		int frames = 0;
+		while (frames < ImaMusicDecoder::kBlockFrames) {
+			const int count = ogg.read(pcm + frames * channels, ImaMusicDecoder::kBlockFrames - frames);
+			if (count < 0) {
+				// the file is left without the tag, remove it rather than keeping a truncated track
+				warning("Failed to decode music '%s', error %d", srcPath, count);
+				f.close();
+				unlink(cachePath);
+				return false;
+			}
+			if (count == 0) {
+				eof = true;
+				break;
+			}
+			frames += count;
+		}
+		if (frames == 0) {
+			break;
+		}
+		memset(block, 0, sizeof(block));
+		for (int c = 0; c < channels; ++c) {
+			uint8_t *p = block + c * ImaMusicDecoder::kBlockHeaderSize;
+			p[0] = state[c]._predictor & 255;
+			p[1] = (state[c]._predictor >> 8) & 255;
+			p[2] = state[c]._index;
+		}
+		uint8_t *data = block + channels * ImaMusicDecoder::kBlockHeaderSize;
+		for (int i = 0; i < frames; ++i) {
+			if (channels == 2) {
+				data[i] = state[0].encode(pcm[i * 2]) | (state[1].encode(pcm[i * 2 + 1]) << 4);
+			} else {
+				data[i >> 1] |= state[0].encode(pcm[i]) << ((i & 1) ? 4 : 0);
+			}
+		}
+		f.write(block, channels * ImaMusicDecoder::kBlockHeaderSize + channels * ImaMusicDecoder::kBlockFrames / 2);
+		totalFrames += frames;
+	}
+	f.seek(0);
+	f.write((void *)"AWMI", 4);
+	f.seek(24);
+	f.writeUint32LE(totalFrames);
+	if (f.ioErr()) {
+		warning("Failed to write '%s'", cachePath);
+		f.close();
+		unlink(cachePath);
+		return false;
+	}
+	debug(DBG_SND, "Converted '%s' (%d frames) in %d ms", srcPath, totalFrames, SDL_GetTicks() - startTicks);
+	return true;
+}
+
+void MusicCache::convertAll(const char *dataDir) {
+	static const char *dirs[] = { "game/OGG", "game/OGG/original", 0 };
+	char cacheDir[MAXPATHLEN];
+	if (snprintf(cacheDir, sizeof(cacheDir), "%s/cache", dataDir) >= (int)sizeof(cacheDir)) {
+		warning("Music cache path too long for '%s'", dataDir);
+		return;
+	}
+	struct stat s;
+	if (stat(cacheDir, &s) != 0 && mkdir(cacheDir, 0777) != 0) {
+		warning("Unable to create music cache directory '%s'", cacheDir);
+		return;
+	}
+	for (int i = 0; dirs[i]; ++i) {
+		char dirPath[MAXPATHLEN];
+		if (snprintf(dirPath, sizeof(dirPath), "%s/%s", dataDir, dirs[i]) >= (int)sizeof(dirPath)) {
+			continue;
+		}
+		DIR *d = opendir(dirPath);
+		if (!d) {
+			continue;
+		}
+		dirent *de;
+		while ((de = readdir(d)) != NULL) {
+			const char *ext = strrchr(de->d_name, '.');
+			if (!ext || strcasecmp(ext, ".ogg") != 0) {
+				continue;
+			}
+			char srcPath[MAXPATHLEN];
+			if (snprintf(srcPath, sizeof(srcPath), "%s/%s", dirPath, de->d_name) >= (int)sizeof(srcPath)) {
+				continue;
+			}
+			char cachePath[MAXPATHLEN];
+			if (getCachePath(dataDir, srcPath, cachePath, sizeof(cachePath)) && !checkCacheFile(cachePath, srcPath)) {
+				convert(srcPath, cachePath);
+			}
+		}
+		closedir(d);
+	}
+}
@@ -0,0 +1,83 @@
+
+#ifndef MUSIC_CACHE_H__
+#define MUSIC_CACHE_H__
+
+#include <vorbis/vorbisfile.h>
+#include "intern.h"
+#include "file.h"
+
+struct MusicDecoder {
+	int _rate;
+	int _channels;
+
+	MusicDecoder() : _rate(0), _channels(0) {}
+	virtual ~MusicDecoder() {}
+
+	virtual const char *getName() const = 0;
+	virtual bool open(const char *path) = 0;
+	virtual void close() = 0;
+	virtual bool rewind() = 0;
+	virtual int read(int16_t *buf, int frames) = 0; // returns 0 at the end of the track, < 0 on error
+};
+
+struct OggMusicDecoder: MusicDecoder {
+	OggVorbis_File _vf;
+	bool _isOpen;
+
+	OggMusicDecoder() : _isOpen(false) {}
+	virtual ~OggMusicDecoder() { close(); }
+
+	virtual const char *getName() const { return "OGG"; }
+	virtual bool open(const char *path);
+	virtual void close();
+	virtual bool rewind();
+	virtual int read(int16_t *buf, int frames);
+};
+
+struct ImaAdpcmState {
+	int _predictor;
+	int _index;
+
+	int decode(int nibble);
+	int encode(int sample);
+};
+
+// IMA-ADPCM stream cached in <data>/cache, 4 bits per sample and a few
+// additions per decoded sample.
+struct ImaMusicDecoder: MusicDecoder {
+	enum {
+		kHeaderSize = 32,
+		kBlockFrames = 2048,
+		kBlockHeaderSize = 4, // per channel : predictor, index
+	};
+
+	File _f;
+	uint8_t _block[2 * kBlockHeaderSize + kBlockFrames];
+	uint32_t _totalFrames;
+	uint32_t _framesLeft;
+	int _blockPos, _blockLen;
+	ImaAdpcmState _state[2];
+
+	ImaMusicDecoder() : _totalFrames(0), _framesLeft(0), _blockPos(0), _blockLen(0) {}
+
+	virtual const char *getName() const { return "IMA-ADPCM"; }
+	virtual bool open(const char *path);
+	virtual void close();
+	virtual bool rewind();
+	virtual int read(int16_t *buf, int frames);
+
+	int getBlockSize() const { return _channels * kBlockHeaderSize + _channels * kBlockFrames / 2; }
+	bool readBlock();
+};
+
+struct MusicCache {
+	static bool _enabled;
+	static bool _convertOnStart;
+
+	static const char *getCachePath(const char *dataDir, const char *srcPath, char *buf, int bufSize);
+	static bool checkCacheFile(const char *cachePath, const char *srcPath);
+	static bool convert(const char *srcPath, const char *cachePath);
+	static void convertAll(const char *dataDir);
+};
+
+#endif
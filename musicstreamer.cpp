@@ -0,0 +1,240 @@
+
+#include "musicstreamer.h"
+#include "util.h"
+
+MusicStreamer::MusicStreamer()
+	: _mixRate(0), _cacheDataDir(0), _thread(0), _lock(0), _cond(0), _loop(false), _requestNum(0), _quit(false), _ring(0), _underruns(0) {
+	_path[0] = 0;
+	SDL_AtomicSet(&_readPos, 0);
+	SDL_AtomicSet(&_writePos, 0);
+	SDL_AtomicSet(&_playing, 0);
+	SDL_AtomicSet(&_ended, 0);
+}
+
+MusicStreamer::~MusicStreamer() {
+	fini();
+}
+
+bool MusicStreamer::init(int mixRate) {
+	_mixRate = mixRate;
+	_ring = (int16_t *)malloc(kRingSize * sizeof(int16_t));
+	if (!_ring) {
+		warning("Failed to allocate %d bytes (MusicStreamer)", kRingSize * sizeof(int16_t));
+		return false;
+	}
+	_lock = SDL_CreateMutex();
+	_cond = SDL_CreateCond();
+	_thread = SDL_CreateThread(streamerThread, "MusicStreamer", this);
+	if (!_thread) {
+		warning("Unable to create music streamer thread");
+		fini();
+		return false;
+	}
+	return true;
+}
+
+void MusicStreamer::fini() {
+	if (_underruns != 0) {
+		debug(DBG_SND, "MusicStreamer underruns %d", _underruns);
+	}
+	if (_thread) {
+		SDL_LockMutex(_lock);
+		_quit = true;
+		SDL_CondSignal(_cond);
+		SDL_UnlockMutex(_lock);
+		SDL_WaitThread(_thread, 0);
+		_thread = 0;
+	}
+	if (_cond) {
+		SDL_DestroyCond(_cond);
+		_cond = 0;
+	}
+	if (_lock) {
+		SDL_DestroyMutex(_lock);
+		_lock = 0;
+	}
+	if (_ring) {
+		free(_ring);
+		_ring = 0;
+	}
+}
+
+void MusicStreamer::play(const char *path, bool loop) {
+	SDL_LockMutex(_lock);
+	SDL_AtomicSet(&_playing, 0);
+	strncpy(_path, path, sizeof(_path) - 1);
+	_path[sizeof(_path) - 1] = 0;
+	_loop = loop;
+	++_requestNum;
+	SDL_CondSignal(_cond);
+	SDL_UnlockMutex(_lock);
+}
+
+void MusicStreamer::stop() {
+	play("", false);
+}
+
+void MusicStreamer::readSamples(int32_t *buf, int len) {
+	if (!SDL_AtomicGet(&_playing)) {
+		return;
+	}
+	// read before the write position, which is final once the track has ended
+	const bool ended = SDL_AtomicGet(&_ended) != 0;
+	SDL_MemoryBarrierAcquire();
+	const uint32_t readPos = SDL_AtomicGet(&_readPos);
+	const uint32_t writePos = SDL_AtomicGet(&_writePos);
+	SDL_MemoryBarrierAcquire();
+	int count = writePos - readPos;
+	if (count > len) {
+		count = len;
+	}
+	for (int i = 0; i < count; ++i) {
+		buf[i] += _ring[(readPos + i) & (kRingSize - 1)] / 2;
+	}
+	SDL_AtomicSet(&_readPos, readPos + count);
+	if (count < len) {
+		if (ended) {
+			SDL_AtomicSet(&_playing, 0);
+		} else {
+			++_underruns;
+		}
+	}
+}
+
+int MusicStreamer::streamerThread(void *data) {
+	MusicStreamer *ms = (MusicStreamer *)data;
+	int requestNum = 0;
+	SDL_LockMutex(ms->_lock);
+	while (!ms->_quit) {
+		if (requestNum == ms->_requestNum) {
+			SDL_CondWait(ms->_cond, ms->_lock);
+			continue;
+		}
+		requestNum = ms->_requestNum;
+		char path[MAXPATHLEN];
+		strcpy(path, ms->_path);
+		const bool loop = ms->_loop;
+		SDL_UnlockMutex(ms->_lock);
+		ms->flush();
+		if (path[0]) {
+			ms->streamTrack(path, loop, requestNum);
+		}
+		SDL_LockMutex(ms->_lock);
+	}
+	SDL_UnlockMutex(ms->_lock);
+	return 0;
+}
+
+void MusicStreamer::flush() {
+	SDL_LockAudio();
+	SDL_AtomicSet(&_playing, 0);
+	SDL_AtomicSet(&_ended, 0);
+	SDL_AtomicSet(&_readPos, 0);
+	SDL_AtomicSet(&_writePos, 0);
+	SDL_UnlockAudio();
+}
+
+int MusicStreamer::getFreeSamples() {
+	const uint32_t readPos = SDL_AtomicGet(&_readPos);
+	const uint32_t writePos = SDL_AtomicGet(&_writePos);
+	return kRingSize - (int)(writePos - readPos);
+}
+
+bool MusicStreamer::hasNewRequest(int requestNum) {
+	SDL_LockMutex(_lock);
+	const bool ret = _quit || _requestNum != requestNum;
+	SDL_UnlockMutex(_lock);
+	return ret;
+}
+
+// checked under the lock, play() clears _playing when it posts a new request
+bool MusicStreamer::startPlaying(int requestNum) {
+	SDL_LockMutex(_lock);
+	const bool ret = !_quit && _requestNum == requestNum;
+	if (ret) {
+		SDL_AtomicSet(&_playing, 1);
+	}
+	SDL_UnlockMutex(_lock);
+	return ret;
+}
+
+MusicDecoder *MusicStreamer::openTrack(const char *path) {
+	if (_cacheDataDir) {
+		char cachePath[MAXPATHLEN];
+		if (MusicCache::getCachePath(_cacheDataDir, path, cachePath, sizeof(cachePath)) && MusicCache::checkCacheFile(cachePath, path) && _ima.open(cachePath)) {
+			return &_ima;
+		}
+	}
+	if (_ogg.open(path)) {
+		return &_ogg;
+	}
+	warning("Failed to open music '%s'", path);
+	return 0;
+}
+
+void MusicStreamer::streamTrack(const char *path, bool loop, int requestNum) {
+	const uint32_t startTicks = SDL_GetTicks();
+	MusicDecoder *decoder = openTrack(path);
+	if (!decoder) {
+		return;
+	}
+	const int channels = decoder->_channels;
+	debug(DBG_SND, "MusicStreamer '%s' %s rate %d channels %d", path, decoder->getName(), decoder->_rate, channels);
+	Frac rate;
+	rate.reset(decoder->_rate, _mixRate);
+	uint32_t frames = 0;
+	uint64_t decodeCounter = 0;
+	uint32_t decodedFrames = 0;
+	while (!hasNewRequest(requestNum)) {
+		if (rate.getInt() >= frames) {
+			const uint64_t counter = SDL_GetPerformanceCounter();
+			const int count = decoder->read(_pcm, kChunkFrames);
+			decodeCounter += SDL_GetPerformanceCounter() - counter;
+			if (count == 0) {
+				if (loop && decoder->rewind()) {
+					continue;
+				}
+				break;
+			} else if (count < 0) {
+				warning("Error %d decoding music '%s'", count, path);
+				break;
+			}
+			rate.offset -= ((uint64_t)frames) << Frac::BITS;
+			frames = count;
+			decodedFrames += count;
+			continue;
+		}
+		int freeSamples = getFreeSamples();
+		if (freeSamples < 2) {
+			SDL_LockMutex(_lock);
+			if (!_quit && _requestNum == requestNum) {
+				SDL_CondWaitTimeout(_cond, _lock, 10);
+			}
+			SDL_UnlockMutex(_lock);
+			continue;
+		}
+		uint32_t writePos = SDL_AtomicGet(&_writePos);
+		for (; freeSamples >= 2 && rate.getInt() < frames; freeSamples -= 2) {
+			const int16_t *p = _pcm + rate.getInt() * channels;
+			_ring[writePos & (kRingSize - 1)] = p[0];
+			_ring[(writePos + 1) & (kRingSize - 1)] = p[channels - 1];
+			writePos += 2;
+			rate.offset += rate.inc;
+		}
+		SDL_MemoryBarrierRelease();
+		SDL_AtomicSet(&_writePos, writePos);
+		if (!SDL_AtomicGet(&_playing) && kRingSize - freeSamples >= kLowWater && startPlaying(requestNum)) {
+			debug(DBG_SND, "MusicStreamer started '%s' after %d ms", path, SDL_GetTicks() - startTicks);
+		}
+	}
+	// the audio callback stops once it has played the samples left in the ring buffer
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicSet(&_ended, 1);
+	// play whatever is left of a track shorter than the low-water mark
+	startPlaying(requestNum);
+	if (decodedFrames != 0) {
+		const int usPerSecond = (int)(decodeCounter * 1000000 / SDL_GetPerformanceFrequency() * decoder->_rate / decodedFrames);
+		debug(DBG_SND, "MusicStreamer %s decoding cost %d us per second of music", decoder->getName(), usPerSecond);
+	}
+	decoder->close();
+}
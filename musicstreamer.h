@@ -0,0 +1,65 @@
+
+#ifndef MUSIC_STREAMER_H__
+#define MUSIC_STREAMER_H__
+
+#include <SDL.h>
+#include "intern.h"
+#include "musiccache.h"
+
+// Decodes music on a background thread into a ring buffer read by the
+// audio callback, track switches never wait for the file to be opened.
+// Tracks converted by MusicCache are used in place of the OGG files.
+struct MusicStreamer {
+
+	enum {
+		kRingSize = 32768 * 2, // stereo samples, must be a power of 2
+		kChunkFrames = 1024, // frames decoded per call
+		kLowWater = 8192 * 2, // samples buffered before playback starts
+	};
+
+	int _mixRate;
+	const char *_cacheDataDir;
+	SDL_Thread *_thread;
+	SDL_mutex *_lock;
+	SDL_cond *_cond;
+
+	// requests, protected by _lock
+	char _path[MAXPATHLEN];
+	bool _loop;
+	int _requestNum;
+	bool _quit;
+
+	// ring buffer, written by the streamer thread and read by the audio callback
+	int16_t *_ring;
+	SDL_atomic_t _readPos, _writePos;
+	SDL_atomic_t _playing;
+	SDL_atomic_t _ended; // the streamer thread has written the last samples of the track
+	int _underruns; // written by the audio callback
+
+	// owned by the streamer thread
+	OggMusicDecoder _ogg;
+	ImaMusicDecoder _ima;
+	int16_t _pcm[kChunkFrames * 2];
+
+	MusicStreamer();
+	~MusicStreamer();
+
+	bool init(int mixRate);
+	void fini();
+
+	void setCacheDir(const char *dataDir) { _cacheDataDir = dataDir; }
+	void play(const char *path, bool loop);
+	void stop();
+
+	void readSamples(int32_t *buf, int len); // mixed into buf, called from the audio callback
+
+	static int streamerThread(void *data);
+	MusicDecoder *openTrack(const char *path);
+	void streamTrack(const char *path, bool loop, int requestNum);
+	void flush();
+	int getFreeSamples();
+	bool hasNewRequest(int requestNum);
+	bool startPlaying(int requestNum);
+};
+
+#endif
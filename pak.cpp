@@ -1,4 +1,5 @@
 
+#include <ctype.h>
 #include "pak.h"
 #include "util.h"
 
@@ -6,9 +7,15 @@
 static const uint32_t XOR_KEY2 = 0x22683297;
 static const uint32_t CHECKSUM = 0x20202020;
 
-static uint8_t *decode_toodc(uint8_t *p, int count) {
-	uint32_t key = XOR_KEY2;
-	uint32_t acc = 0;
+struct ToodcState {
+	uint32_t key;
+	uint32_t acc;
+};
+
+// the key of the next word depends on the encoded bytes of the current one
+static void decode_toodc(ToodcState *state, uint8_t *p, int count) {
+	uint32_t key = state->key;
+	uint32_t acc = state->acc;
 	for (int i = 0; i < count; ++i) {
 		uint8_t *q = p + i * 4;
 		const uint32_t data = READ_LE_UINT32(q) ^ key;
@@ -18,13 +25,24 @@ static uint8_t *decode_toodc(uint8_t *p, int count) {
 		acc += 0x4D;
 		WRITE_LE_UINT32(q, data);
 	}
-	return p + 4;
+	state->key = key;
+	state->acc = acc;
+}
+
+// FNV-1a of the lower case name
+static uint32_t hashName(const char *name) {
+	uint32_t hash = 2166136261U;
+	for (; *name; ++name) {
+		hash ^= (uint8_t)tolower(*name);
+		hash *= 16777619U;
+	}
+	return hash;
 }
 
 const char *Pak::FILENAME = "Pak01.pak";
 
 Pak::Pak()
-	: _entries(0), _entriesCount(0) {
+	: _entries(0), _entriesCount(0), _hashTable(0), _hashMask(0) {
 }
 
 Pak::~Pak() {
@@ -39,10 +57,9 @@ void Pak::close() {
 	free(_entries);
 	_entries = 0;
 	_entriesCount = 0;
-}
-
-static int comparePakEntry(const void *a, const void *b) {
-	return strcasecmp(((PakEntry *)a)->name, ((PakEntry *)b)->name);
+	free(_hashTable);
+	_hashTable = 0;
+	_hashMask = 0;
 }
 
 void Pak::readEntries() {
@@ -79,7 +96,7 @@ void Pak::readEntries() {
 		e->size = READ_LE_UINT32(buf + 0x3C);
 		debug(DBG_PAK, "Pak::readEntries() buf '%s' size %d", e->name, e->size);
 	}
-	qsort(_entries, _entriesCount, sizeof(PakEntry), comparePakEntry);
+	buildHashTable();
 	// the original executable descrambles the (ke)y.txt file and check the last 4 bytes.
 	// this has been disabled in later re-releases and a key is bundled in the data files
 	if (0) {
@@ -95,11 +112,44 @@ void Pak::readEntries() {
 	}
 }
 
+// open addressing with linear probing, the table is at most half full
+void Pak::buildHashTable() {
+	int size = 16;
+	while (size < _entriesCount * 2) {
+		size *= 2;
+	}
+	_hashTable = (int *)malloc(size * sizeof(int));
+	if (!_hashTable) {
+		return;
+	}
+	memset(_hashTable, 0xFF, size * sizeof(int));
+	_hashMask = size - 1;
+	for (int i = 0; i < _entriesCount; ++i) {
+		if (_entries[i].name[0] == 0) {
+			continue;
+		}
+		uint32_t slot = hashName(_entries[i].name) & _hashMask;
+		while (_hashTable[slot] != -1) {
+			slot = (slot + 1) & _hashMask;
+		}
+		_hashTable[slot] = i;
+	}
+}
+
 const PakEntry *Pak::find(const char *name) {
 	debug(DBG_PAK, "Pak::find() '%s'", name);
-	PakEntry tmp;
-	strcpy(tmp.name, name);
-	return (const PakEntry *)bsearch(&tmp, _entries, _entriesCount, sizeof(PakEntry), comparePakEntry);
+	if (!_hashTable) {
+		return 0;
+	}
+	uint32_t slot = hashName(name) & _hashMask;
+	while (_hashTable[slot] != -1) {
+		const PakEntry *e = &_entries[_hashTable[slot]];
+		if (strcasecmp(e->name, name) == 0) {
+			return e;
+		}
+		slot = (slot + 1) & _hashMask;
+	}
+	return 0;
 }
 
 void Pak::loadData(const PakEntry *e, uint8_t *buf, uint32_t *size) {
@@ -109,8 +159,12 @@ void Pak::loadData(const PakEntry *e, uint8_t *buf, uint32_t *size) {
 		*size = 0;
 		return;
 	}
-	_f.read(buf, e->size);
-	if (e->size > 5 && memcmp(buf, "TooDC", 5) == 0) {
+	// 'TooDC', a padding byte and a scrambled word preceding the data
+	uint8_t header[10];
+	if (e->size >= sizeof(header)) {
+		_f.read(header, sizeof(header));
+	}
+	if (e->size >= sizeof(header) && memcmp(header, "TooDC", 5) == 0) {
 		const int dataSize = e->size - 6;
 		debug(DBG_PAK, "Pak::loadData() encoded TooDC data, size %d", dataSize);
 		if ((dataSize & 3) != 0) {
@@ -118,9 +172,17 @@ void Pak::loadData(const PakEntry *e, uint8_t *buf, uint32_t *size) {
 			warning("Unexpected size %d for encoded TooDC data '%s'", dataSize, e->name);
 		}
 		*size = dataSize - 4;
-		decode_toodc(buf + 6, (dataSize + 3) / 4);
-		memmove(buf, buf + 10, dataSize - 4);
+		// the data is read to the start of the buffer, the first word only updates the key
+		ToodcState state;
+		state.key = XOR_KEY2;
+		state.acc = 0;
+		decode_toodc(&state, header + 6, 1);
+		_f.read(buf, dataSize - 4);
+		decode_toodc(&state, buf, (dataSize - 4 + 3) / 4);
 	} else {
+		const uint32_t offset = MIN<uint32_t>(e->size, sizeof(header));
+		memcpy(buf, header, offset);
+		_f.read(buf + offset, e->size - offset);
 		*size = e->size;
 	}
 }
@@ -17,6 +17,8 @@ struct Pak {
 	File _f;
 	PakEntry *_entries;
 	int _entriesCount;
+	int *_hashTable; // indexes in _entries, -1 for empty slots
+	int _hashMask;
 
 	Pak();
 	~Pak();
@@ -25,6 +27,7 @@ struct Pak {
 	void close();
 
 	void readEntries();
+	void buildHashTable();
 	const PakEntry *find(const char *name);
 	void loadData(const PakEntry *e, uint8_t *buf, uint32_t *size);
 };
@@ -0,0 +1,279 @@
+
+#include "prefetcher.h"
+#include "util.h"
+
+Prefetcher::Prefetcher()
+	: _proc(0), _userdata(0), _thread(0), _lock(0), _cond(0), _jobsCount(0), _nextJob(0), _bytesCount(0), _stagingBytesCount(0), _quit(false), _hits(0), _waits(0), _misses(0) {
+}
+
+Prefetcher::~Prefetcher() {
+	fini();
+}
+
+bool Prefetcher::init(PrefetchProc proc, void *userdata) {
+	_proc = proc;
+	_userdata = userdata;
+	_lock = SDL_CreateMutex();
+	_cond = SDL_CreateCond();
+	_thread = SDL_CreateThreadWithStackSize(prefetchThread, "Prefetcher", kStackSize, this);
+	if (!_thread) {
+		warning("Unable to create prefetcher thread");
+		fini();
+		return false;
+	}
+	return true;
+}
+
+void Prefetcher::fini() {
+	if (_thread) {
+		flush();
+		SDL_LockMutex(_lock);
+		_quit = true;
+		SDL_CondBroadcast(_cond);
+		SDL_UnlockMutex(_lock);
+		SDL_WaitThread(_thread, 0);
+		_thread = 0;
+	}
+	if (_cond) {
+		SDL_DestroyCond(_cond);
+		_cond = 0;
+	}
+	if (_lock) {
+		SDL_DestroyMutex(_lock);
+		_lock = 0;
+	}
+}
+
+// number of operand bytes, -1 for the opcodes with variable length operands
+static const int8_t _opSizes[] = {
+	/* 0x00 */
+	3, 2, 2, 3, 2, 0, 0, 2,
+	/* 0x08 */
+	3, 3, -1, 2, 3, 1, 2, 2,
+	/* 0x10 */
+	1, 0, 5, 2, 3, 3, 3, 3,
+	/* 0x18 */
+	5, 2, 5
+};
+
+// the 3DO version redefines some of the opcodes (see Script::executeTask)
+static int getOpSize3DO(int opcode) {
+	switch (opcode) {
+	case 11:
+	case 26:
+		return 1;
+	case 22:
+	case 23:
+		return 2;
+	case 27:
+		return 5;
+	case 28:
+	case 29:
+		return 3;
+	case 30:
+		return 0;
+	}
+	return (opcode <= 0x1A) ? _opSizes[opcode] : -2;
+}
+
+// linear sweep over the part bytecode, the segment does not mix code and data
+int Prefetcher::findResources(const uint8_t *code, uint32_t size, bool is3DO, PrefetchRes *res, int count) {
+	int resCount = 0;
+	uint32_t pos = 0;
+	while (pos < size) {
+		const uint8_t opcode = code[pos++];
+		int len;
+		if (opcode & 0x80) {
+			len = 3;
+		} else if (opcode & 0x40) {
+			len = 4;
+			if (!(opcode & 0x20) && !(opcode & 0x10)) {
+				++len;
+			}
+			if (!(opcode & 8) && !(opcode & 4)) {
+				++len;
+			}
+			if ((opcode & 3) == 1 || (opcode & 3) == 2) {
+				++len;
+			}
+		} else {
+			len = is3DO ? getOpSize3DO(opcode) : (opcode <= 0x1A) ? _opSizes[opcode] : -2;
+			if (len == -1) { // op_condJmp
+				if (pos >= size) {
+					break;
+				}
+				len = (code[pos] & 0x80) ? 5 : (code[pos] & 0x40) ? 6 : 5;
+			} else if (len < 0) {
+				warning("Prefetcher::findResources() invalid opcode 0x%X at 0x%X", opcode, pos - 1);
+				break;
+			}
+		}
+		if (pos + len > size) {
+			break;
+		}
+		if ((opcode == 0x18 || opcode == 0x19 || (opcode == 0x1A && !is3DO)) && resCount < count) {
+			const uint16_t num = READ_BE_UINT16(code + pos);
+			bool found = false;
+			for (int i = 0; i < resCount && !found; ++i) {
+				found = (res[i].num == num && res[i].opcode == opcode);
+			}
+			if (!found) {
+				res[resCount].opcode = opcode;
+				res[resCount].num = num;
+				++resCount;
+			}
+		}
+		pos += len;
+	}
+	return resCount;
+}
+
+void Prefetcher::queue(int type, int num, uint32_t sizeHint, bool staging) {
+	SDL_LockMutex(_lock);
+	PrefetchJob *found = 0;
+	for (int i = 0; i < _jobsCount && !found; ++i) {
+		if (_jobs[i].type == type && _jobs[i].num == num) {
+			found = &_jobs[i];
+		}
+	}
+	if (found) {
+		// also needed by the next part
+		if (staging && !found->staging) {
+			found->staging = true;
+			if (found->state == PrefetchJob::kStateReady) {
+				_bytesCount -= found->size;
+				_stagingBytesCount += found->size;
+			}
+		}
+	} else if (_jobsCount < kMaxJobs) {
+		PrefetchJob *job = &_jobs[_jobsCount++];
+		job->type = type;
+		job->num = num;
+		job->sizeHint = sizeHint;
+		job->staging = staging;
+		job->state = PrefetchJob::kStatePending;
+		job->data = 0;
+		job->size = 0;
+	}
+	SDL_UnlockMutex(_lock);
+}
+
+void Prefetcher::start() {
+	SDL_LockMutex(_lock);
+	SDL_CondBroadcast(_cond);
+	SDL_UnlockMutex(_lock);
+}
+
+// the staged jobs are kept as regular jobs of the part being set up
+void Prefetcher::flush(bool keepStaging) {
+	SDL_LockMutex(_lock);
+	for (int i = _nextJob; i < _jobsCount; ++i) {
+		if (!keepStaging || !_jobs[i].staging) {
+			_jobs[i].state = PrefetchJob::kStateSkipped;
+		}
+	}
+	_nextJob = _jobsCount; // no new job is started until the array is compacted
+	if (_jobsCount != 0) {
+		debug(DBG_RESOURCE, "Prefetcher jobs %d bytes %d staged %d hits %d waits %d misses %d", _jobsCount, _bytesCount, _stagingBytesCount, _hits, _waits, _misses);
+	}
+	int count = 0;
+	_bytesCount = 0;
+	for (int i = 0; i < _jobsCount; ++i) {
+		while (_jobs[i].state == PrefetchJob::kStateLoading) {
+			SDL_CondWait(_cond, _lock);
+		}
+		if (keepStaging && _jobs[i].staging && _jobs[i].state != PrefetchJob::kStateSkipped) {
+			PrefetchJob *job = &_jobs[count++];
+			*job = _jobs[i];
+			job->staging = false;
+			_bytesCount += job->size;
+		} else if (_jobs[i].data) {
+			free(_jobs[i].data);
+		}
+	}
+	_jobsCount = count;
+	_nextJob = 0;
+	_stagingBytesCount = 0;
+	SDL_UnlockMutex(_lock);
+}
+
+const uint8_t *Prefetcher::find(int type, int num, uint32_t *size) {
+	const uint8_t *data = 0;
+	SDL_LockMutex(_lock);
+	for (int i = 0; i < _jobsCount; ++i) {
+		PrefetchJob *job = &_jobs[i];
+		if (job->type != type || job->num != num) {
+			continue;
+		}
+		if (job->state == PrefetchJob::kStatePending) {
+			// the caller loads it now, the thread would be too late
+			job->state = PrefetchJob::kStateSkipped;
+			++_misses;
+		} else if (job->state == PrefetchJob::kStateLoading) {
+			++_waits;
+			while (job->state == PrefetchJob::kStateLoading) {
+				SDL_CondWait(_cond, _lock);
+			}
+		} else if (job->state == PrefetchJob::kStateReady) {
+			++_hits;
+		}
+		if (job->state == PrefetchJob::kStateReady) {
+			data = job->data;
+			*size = job->size;
+		}
+		break;
+	}
+	SDL_UnlockMutex(_lock);
+	return data;
+}
+
+int Prefetcher::prefetchThread(void *data) {
+	Prefetcher *p = (Prefetcher *)data;
+	p->runJobs();
+	return 0;
+}
+
+void Prefetcher::runJobs() {
+	SDL_LockMutex(_lock);
+	while (!_quit) {
+		if (_nextJob >= _jobsCount) {
+			SDL_CondWait(_cond, _lock);
+			continue;
+		}
+		PrefetchJob *job = &_jobs[_nextJob++];
+		if (job->state != PrefetchJob::kStatePending) {
+			continue;
+		}
+		uint32_t *bytesCount = job->staging ? &_stagingBytesCount : &_bytesCount;
+		uint32_t maxBytes = job->staging ? kMaxStagingBytes : kMaxBytes;
+		if (*bytesCount + job->sizeHint > maxBytes) {
+			job->state = PrefetchJob::kStateSkipped;
+			continue;
+		}
+		job->state = PrefetchJob::kStateLoading;
+		const int type = job->type;
+		const int num = job->num;
+		SDL_UnlockMutex(_lock);
+		uint32_t size = 0;
+		uint8_t *buf = _proc(_userdata, type, num, &size);
+		SDL_LockMutex(_lock);
+		if (job->staging) { // queued again for the next part while loading
+			bytesCount = &_stagingBytesCount;
+			maxBytes = kMaxStagingBytes;
+		}
+		if (buf && *bytesCount + size > maxBytes) {
+			free(buf);
+			buf = 0;
+		}
+		if (buf) {
+			job->data = buf;
+			job->size = size;
+			job->state = PrefetchJob::kStateReady;
+			*bytesCount += size;
+		} else {
+			job->state = PrefetchJob::kStateSkipped;
+		}
+		SDL_CondBroadcast(_cond);
+	}
+	SDL_UnlockMutex(_lock);
+}
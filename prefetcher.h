@@ -0,0 +1,80 @@
+
+#ifndef PREFETCHER_H__
+#define PREFETCHER_H__
+
+#include <SDL.h>
+#include "intern.h"
+
+struct PrefetchRes {
+	uint8_t opcode; // op_playSound, op_updateResources or op_playMusic
+	uint16_t num;
+};
+
+struct PrefetchJob {
+	enum {
+		kStatePending,
+		kStateLoading,
+		kStateReady,
+		kStateSkipped,
+	};
+
+	int type; // Resource::DataType specific, passed back to the load proc
+	int num;
+	uint32_t sizeHint; // 0 if unknown before loading
+	bool staging; // next part data, kept by flush(true)
+	int state;
+	uint8_t *data;
+	uint32_t size;
+};
+
+// returns a buffer allocated with malloc, called from the prefetcher thread
+typedef uint8_t *(*PrefetchProc)(void *userdata, int type, int num, uint32_t *size);
+
+// Loads the resources a part may request on a background thread, in the
+// order they were queued. The loaded data stays resident until flush().
+// The segments of the next part are staged with their own budget.
+struct Prefetcher {
+
+	enum {
+		kMaxJobs = 128,
+		kMaxBytes = 2 * 1024 * 1024,
+		kMaxStagingBytes = 512 * 1024,
+		kStackSize = 128 * 1024, // above the default for the decoders
+	};
+
+	static bool _enabled;
+
+	PrefetchProc _proc;
+	void *_userdata;
+	SDL_Thread *_thread;
+	SDL_mutex *_lock;
+	SDL_cond *_cond;
+
+	// protected by _lock
+	PrefetchJob _jobs[kMaxJobs];
+	int _jobsCount;
+	int _nextJob;
+	uint32_t _bytesCount;
+	uint32_t _stagingBytesCount;
+	bool _quit;
+
+	int _hits, _waits, _misses;
+
+	Prefetcher();
+	~Prefetcher();
+
+	bool init(PrefetchProc proc, void *userdata);
+	void fini();
+
+	static int findResources(const uint8_t *code, uint32_t size, bool is3DO, PrefetchRes *res, int count);
+
+	void queue(int type, int num, uint32_t sizeHint, bool staging = false);
+	void start();
+	void flush(bool keepStaging = false);
+	const uint8_t *find(int type, int num, uint32_t *size); // waits for the job if it is being loaded
+
+	static int prefetchThread(void *data);
+	void runJobs();
+};
+
+#endif
@@ -4,20 +4,24 @@
  * Copyright (C) 2004-2005 Gregory Montoir (cyx@users.sourceforge.net)
  */
 
+#include <sys/stat.h>
 #include "resource.h"
+#include "bgcache.h"
 #include "file.h"
 #include "pak.h"
+#include "prefetcher.h"
 #include "resource_nth.h"
 #include "resource_win31.h"
 #include "resource_3do.h"
 #include "unpack.h"
+#include "unpackcache.h"
 #include "util.h"
 #include "video.h"
 
 static const char *atariDemo = "aw.tos";
 
 Resource::Resource(Video *vid, const char *dataDir)
-	: _vid(vid), _dataDir(dataDir), _currentPart(0), _nextPart(0), _dataType(DT_DOS), _nth(0), _win31(0), _3do(0) {
+	: _vid(vid), _dataDir(dataDir), _currentPart(0), _nextPart(0), _dataType(DT_DOS), _nth(0), _bgCache(0), _win31(0), _3do(0) {
 	_bankPrefix = "bank";
 	_hasPasswordScreen = true;
 	memset(_memList, 0, sizeof(_memList));
@@ -28,26 +32,133 @@ Resource::Resource(Video *vid, const char *dataDir)
 	_lang = LANG_FR;
 	_amigaMemList = 0;
 	memset(&_demo3Joy, 0, sizeof(_demo3Joy));
+	memset(_bankFiles, 0, sizeof(_bankFiles));
+	_unpackCache = 0;
+	_prefetcher = 0;
+	_segCodeSize = 0;
+	_stagedPart = 0;
+	_hdDatKey = -1;
+	_pinnedHdDats = false;
+	_memPtrStart = 0;
+	_memChunksCount = _memChunksBakCount = 0;
+	memset(_memUsage, 0, sizeof(_memUsage));
+	memset(_memUsageBak, 0, sizeof(_memUsageBak));
+	_memHighWater = 0;
+	memset(_partsHighWater, 0, sizeof(_partsHighWater));
 }
 
 Resource::~Resource() {
 	free(_demo3Joy.bufPtr);
+	for (int i = 0; i < BANK_FILES_COUNT; ++i) {
+		delete _bankFiles[i];
+	}
+	delete _bgCache;
+	delete _prefetcher;
+	delete _unpackCache;
 	delete _nth;
 	delete _win31;
 	delete _3do;
 }
 
-bool Resource::readBank(const MemEntry *me, uint8_t *dstBuf) {
-	bool ret = false;
+static bool openBank(File &f, const char *prefix, int bankNum, const char *dataDir, bool atariDemoData) {
 	char name[10];
-	snprintf(name, sizeof(name), "%s%02x", _bankPrefix, me->bankNum);
-	File f;
-	if (f.open(name, _dataDir) || (_dataType == DT_ATARI_DEMO && f.open(atariDemo, _dataDir))) {
-		f.seek(me->bankPos);
-		const size_t count = f.read(dstBuf, me->packedSize);
-		ret = (count == me->packedSize);
-		if (ret && me->packedSize != me->unpackedSize) {
-			ret = bytekiller_unpack(dstBuf, me->unpackedSize, dstBuf, me->packedSize);
+	snprintf(name, sizeof(name), "%s%02x", prefix, bankNum);
+	return f.open(name, dataDir) || (atariDemoData && f.open(atariDemo, dataDir));
+}
+
+enum {
+	kPrefetchBank,
+	kPrefetchWav,
+	kPrefetchFile3do,
+	kPrefetchDat,
+	kPrefetchHdDat, // num is part * 4 + segment
+};
+
+// called from the prefetcher thread, the bank fields of the entries do not change after readEntries()
+static uint8_t *prefetchResource(void *userdata, int type, int num, uint32_t *size) {
+	Resource *res = (Resource *)userdata;
+	switch (type) {
+	case kPrefetchBank: {
+			const MemEntry *me = &res->_memList[num];
+			File f;
+			if (!openBank(f, res->_bankPrefix, me->bankNum, res->_dataDir, res->_dataType == Resource::DT_ATARI_DEMO)) {
+				return 0;
+			}
+			uint8_t *p = (uint8_t *)malloc(me->unpackedSize);
+			if (!p) {
+				return 0;
+			}
+			f.seek(me->bankPos);
+			bool ret = (f.read(p, me->packedSize) == (int)me->packedSize);
+			if (ret && me->packedSize != me->unpackedSize) {
+				ret = bytekiller_unpack(p, me->unpackedSize, p, me->packedSize);
+			}
+			if (!ret) {
+				free(p);
+				return 0;
+			}
+			*size = me->unpackedSize;
+			return p;
+		}
+	case kPrefetchWav:
+		return res->_nth->prefetchWav(num, size);
+	case kPrefetchFile3do:
+		return res->_3do->prefetchFile(num, size);
+	case kPrefetchDat:
+		return res->_nth->prefetchDat(num, size);
+	case kPrefetchHdDat:
+		return res->_nth->prefetchHdDat(num >> 2, num & 3, size);
+	}
+	return 0;
+}
+
+// bank files are opened once and kept open
+File *Resource::getBankFile(int bankNum) {
+	if (bankNum >= BANK_FILES_COUNT) {
+		return 0;
+	}
+	if (!_bankFiles[bankNum]) {
+		File *f = new File;
+		if (!openBank(*f, _bankPrefix, bankNum, _dataDir, _dataType == DT_ATARI_DEMO)) {
+			delete f;
+			return 0;
+		}
+		_bankFiles[bankNum] = f;
+	}
+	return _bankFiles[bankNum];
+}
+
+bool Resource::readBank(const MemEntry *me, uint8_t *dstBuf) {
+	if (_prefetcher) {
+		uint32_t size = 0;
+		const uint8_t *p = _prefetcher->find(kPrefetchBank, me - _memList, &size);
+		if (p && size == me->unpackedSize) {
+			memcpy(dstBuf, p, size);
+			return true;
+		}
+	}
+	const bool packed = (me->packedSize != me->unpackedSize);
+	if (packed && _unpackCache) {
+		const UnpackCacheEntry *e = _unpackCache->find(me);
+		if (e && _unpackCache->read(e, dstBuf)) {
+			return true;
+		}
+	}
+	File tmp;
+	File *f = getBankFile(me->bankNum);
+	if (!f) {
+		if (me->bankNum < BANK_FILES_COUNT || !openBank(tmp, _bankPrefix, me->bankNum, _dataDir, _dataType == DT_ATARI_DEMO)) {
+			return false;
+		}
+		f = &tmp;
+	}
+	f->seek(me->bankPos);
+	const size_t count = f->read(dstBuf, me->packedSize);
+	bool ret = (count == me->packedSize);
+	if (ret && packed) {
+		ret = bytekiller_unpack(dstBuf, me->unpackedSize, dstBuf, me->packedSize);
+		if (ret && _unpackCache) {
+			_unpackCache->add(me, dstBuf);
 		}
 	}
 	return ret;
@@ -284,60 +395,105 @@ void Resource::dumpEntries() {
 	}
 }
 
-void Resource::load() {
-	while (1) {
-		MemEntry *me = 0;
+struct LoadEntry {
+	MemEntry *me;
+	int num;
+	uint8_t *dst;
+};
 
-		// get resource with max rankNum
-		uint8_t maxNum = 0;
-		for (int i = 0; i < _numMemList; ++i) {
-			MemEntry *it = &_memList[i];
-			if (it->status == STATUS_TOLOAD && maxNum <= it->rankNum) {
-				maxNum = it->rankNum;
-				me = it;
-			}
-		}
-		if (me == 0) {
-			break; // no entry found
-		}
+// memory is laid out by decreasing rank, the last entry listed first for equal ranks
+static int compareLoadEntryRank(const void *a, const void *b) {
+	const LoadEntry *e1 = (const LoadEntry *)a;
+	const LoadEntry *e2 = (const LoadEntry *)b;
+	if (e1->me->rankNum != e2->me->rankNum) {
+		return e2->me->rankNum - e1->me->rankNum;
+	}
+	return e2->num - e1->num;
+}
 
-		const int resourceNum = me - _memList;
+// reads are issued in file order
+static int compareLoadEntryBank(const void *a, const void *b) {
+	const LoadEntry *e1 = (const LoadEntry *)a;
+	const LoadEntry *e2 = (const LoadEntry *)b;
+	if (e1->me->bankNum != e2->me->bankNum) {
+		return e1->me->bankNum - e2->me->bankNum;
+	}
+	if (e1->me->bankPos != e2->me->bankPos) {
+		return (e1->me->bankPos < e2->me->bankPos) ? -1 : 1;
+	}
+	return e1->num - e2->num;
+}
 
-		uint8_t *memPtr = 0;
-		if (me->type == RT_BITMAP) {
-			memPtr = _vidCurPtr;
-		} else {
-			memPtr = _scriptCurPtr;
-			const uint32_t avail = uint32_t(_vidCurPtr - _scriptCurPtr);
-			if (me->unpackedSize > avail) {
-				warning("Resource::load() not enough memory, available=%d", avail);
-				me->status = STATUS_NULL;
-				continue;
-			}
+// DOS demo version does not have the bank for this resource
+// this should be safe to ignore as the resource does not appear to be used by the game code
+static bool isMissingDemoBank(Resource::DataType dataType, const MemEntry *me) {
+	return dataType == Resource::DT_DOS && me->bankNum == 12 && me->type == Resource::RT_BANK;
+}
+
+void Resource::load() {
+	LoadEntry entries[ENTRIES_COUNT_20TH];
+	int count = 0;
+	for (int i = 0; i < _numMemList; ++i) {
+		if (_memList[i].status == STATUS_TOLOAD) {
+			entries[count].me = &_memList[i];
+			entries[count].num = i;
+			entries[count].dst = 0;
+			++count;
 		}
+	}
+	if (count == 0) {
+		return;
+	}
+	qsort(entries, count, sizeof(LoadEntry), compareLoadEntryRank);
+
+	// place the entries in memory, bitmaps are decoded to the video page in rank order
+	LoadEntry bitmaps[ENTRIES_COUNT_20TH];
+	int bitmapsCount = 0;
+	int readCount = 0;
+	for (int i = 0; i < count; ++i) {
+		MemEntry *me = entries[i].me;
 		if (me->bankNum == 0) {
 			warning("Resource::load() ec=0x%X (me->bankNum == 0)", 0xF00);
 			me->status = STATUS_NULL;
-		} else {
-			debug(DBG_BANK, "Resource::load() bufPos=0x%X size=%d type=%d pos=0x%X bankNum=%d", memPtr - _memPtrStart, me->packedSize, me->type, me->bankPos, me->bankNum);
-			if (readBank(me, memPtr)) {
-				if (me->type == RT_BITMAP) {
-					_vid->copyBitmapPtr(_vidCurPtr, me->unpackedSize);
-					me->status = STATUS_NULL;
-				} else {
-					me->bufPtr = memPtr;
-					me->status = STATUS_LOADED;
-					_scriptCurPtr += me->unpackedSize;
-				}
+			continue;
+		}
+		if (me->type == RT_BITMAP) {
+			entries[i].dst = _vidCurPtr;
+			bitmaps[bitmapsCount++] = entries[i];
+			continue;
+		}
+		if (me->bankNum < BANK_FILES_COUNT && !getBankFile(me->bankNum) && isMissingDemoBank(_dataType, me)) {
+			me->status = STATUS_NULL;
+			continue;
+		}
+		entries[i].dst = allocMem(me->unpackedSize, me->type);
+		if (!entries[i].dst) {
+			warning("Resource::load() not enough memory for resource %d", entries[i].num);
+			me->status = STATUS_NULL;
+			continue;
+		}
+		entries[readCount++] = entries[i];
+	}
+
+	qsort(entries, readCount, sizeof(LoadEntry), compareLoadEntryBank);
+	for (int i = 0; i < readCount + bitmapsCount; ++i) {
+		const LoadEntry *e = (i < readCount) ? &entries[i] : &bitmaps[i - readCount];
+		MemEntry *me = e->me;
+		debug(DBG_BANK, "Resource::load() bufPos=0x%X size=%d type=%d pos=0x%X bankNum=%d", e->dst - _memPtrStart, me->packedSize, me->type, me->bankPos, me->bankNum);
+		if (readBank(me, e->dst)) {
+			if (me->type == RT_BITMAP) {
+				_vid->copyBitmapPtr(_vidCurPtr, me->unpackedSize);
+				me->status = STATUS_NULL;
 			} else {
-				if (_dataType == DT_DOS && me->bankNum == 12 && me->type == RT_BANK) {
-					// DOS demo version does not have the bank for this resource
-					// this should be safe to ignore as the resource does not appear to be used by the game code
-					me->status = STATUS_NULL;
-					continue;
-				}
-				error("Unable to read resource %d from bank %d", resourceNum, me->bankNum);
+				me->bufPtr = e->dst;
+				me->status = STATUS_LOADED;
+			}
+		} else {
+			if (isMissingDemoBank(_dataType, me)) {
+				me->status = STATUS_NULL;
+				continue;
 			}
+			error("Unable to read resource %d from bank %d", e->num, me->bankNum);
 		}
 	}
 }
@@ -350,14 +506,29 @@ void Resource::invalidateRes() {
 		}
 	}
 	_scriptCurPtr = _scriptBakPtr;
+	freeMemChunks(_memChunksBakCount);
+	for (int i = 0; i < _memChunksCount; ++i) {
+		_memChunks[i].used = _memChunks[i].bakUsed;
+	}
+	memcpy(_memUsage, _memUsageBak, sizeof(_memUsage));
 	_vid->_currentPal = 0xFF;
 }
 
 void Resource::invalidateAll() {
 	for (int i = 0; i < _numMemList; ++i) {
-		_memList[i].status = STATUS_NULL;
+		if (!isPinned(&_memList[i])) {
+			_memList[i].status = STATUS_NULL;
+		}
+	}
+	if (_currentPart >= 16000 && _currentPart <= 16009) {
+		const int part = _currentPart - 16000;
+		_partsHighWater[part] = MAX(_partsHighWater[part], _memHighWater);
+		dumpMem();
 	}
 	_scriptCurPtr = _memPtrStart;
+	freeMemChunks(0);
+	memset(_memUsage, 0, sizeof(_memUsage));
+	_memHighWater = _vidCurPtr - _pinnedPtr;
 	_vid->_currentPal = 0xFF;
 }
 
@@ -466,9 +637,26 @@ void Resource::loadBmp(int num) {
 	uint32_t size = 0;
 	uint8_t *p = 0;
 	switch (_dataType) {
-	case DT_15TH_EDITION:
 	case DT_20TH_EDITION:
-		p = _nth->loadBmp(num);
+		if (_bgCache) {
+			char path[MAXPATHLEN];
+			if (_nth->getBmpPath(num, path, sizeof(path))) {
+				const uint16_t *scaled = _bgCache->load(path);
+				if (!scaled) {
+					p = _nth->loadBmp(num);
+					scaled = p ? _bgCache->convert(path, p) : 0;
+				}
+				if (scaled) {
+					_vid->copyBitmap5551(scaled);
+					break;
+				}
+			}
+		}
+		/* fall-through */
+	case DT_15TH_EDITION:
+		if (!p) {
+			p = _nth->loadBmp(num);
+		}
 		if (p) {
 			_vid->copyBitmapPtr(p, size);
 			// free(p);
@@ -482,7 +670,12 @@ void Resource::loadBmp(int num) {
 		}
 		break;
 	case DT_3DO:
-		p = _3do->loadFile(num, 0, &size);
+		if (_prefetcher) {
+			p = (uint8_t *)_prefetcher->find(kPrefetchFile3do, num, &size);
+		}
+		if (!p) {
+			p = _3do->loadFile(num, 0, &size);
+		}
 		if (p) {
 			_vid->copyBitmapPtr(p, size);
 		}
@@ -492,31 +685,183 @@ void Resource::loadBmp(int num) {
 	}	
 }
 
-uint8_t *Resource::loadDat(int num) {
-	assert(num < _numMemList);
-	if (_memList[num].status == STATUS_LOADED) {
-		return _memList[num].bufPtr;
+void Resource::initBackgroundCache(bool warm) {
+	if (_dataType != DT_20TH_EDITION) {
+		return;
 	}
-	uint32_t size = 0;
-	uint8_t *p = 0;
+	_bgCache = new BackgroundCache;
+	if (!_bgCache->init(_dataDir)) {
+		delete _bgCache;
+		_bgCache = 0;
+		return;
+	}
+	if (warm) {
+		// convert every background found on disk, the numbers above 3000 are sparse
+		int count = 0;
+		char path[MAXPATHLEN];
+		for (int num = 0; num < 4000; ++num) {
+			if (num >= 200 && num < 3000) {
+				num = 3000;
+			}
+			struct stat s;
+			if (!_nth->getBmpPath(num, path, sizeof(path)) || stat(path, &s) != 0 || _bgCache->isCached(path)) {
+				continue;
+			}
+			const uint8_t *p = _nth->loadBmp(num);
+			if (p && _bgCache->convert(path, p)) {
+				++count;
+			}
+		}
+		debug(DBG_RESOURCE, "Converted %d backgrounds", count);
+	}
+}
+
+// the entries loaded by loadDat() are cached for the editions decoding them
+bool Resource::isDatCached() const {
+	return _unpackCache && _dataType == DT_WIN31;
+}
+
+void Resource::initUnpackCache(bool build) {
+	// the cached entries are only valid for the files they were unpacked from
+	uint32_t sourceSizes[UnpackCache::kSourcesCount];
+	memset(sourceSizes, 0, sizeof(sourceSizes));
+	sourceSizes[0] = _dataType;
 	switch (_dataType) {
-	case DT_15TH_EDITION:
-	case DT_20TH_EDITION:
-		p = _nth->loadDat(num, _scriptCurPtr, &size);
+	case DT_AMIGA:
+	case DT_ATARI:
+	case DT_ATARI_DEMO:
+	case DT_DOS:
+		for (int i = 1; i < UnpackCache::kSourcesCount; ++i) {
+			File *f = getBankFile(i);
+			sourceSizes[i] = f ? f->size() : 0;
+		}
 		break;
 	case DT_WIN31:
-		p = _win31->loadFile(num, _scriptCurPtr, &size);
+		sourceSizes[1] = _win31->_f.size();
 		break;
+	default:
+		return;
+	}
+	_unpackCache = new UnpackCache;
+	if (!_unpackCache->init(_dataDir, sourceSizes)) {
+		delete _unpackCache;
+		_unpackCache = 0;
+		return;
+	}
+	if (build && isDatCached()) {
+		int count = 0;
+		for (int num = 1; num < _numMemList; ++num) {
+			const uint32_t sourceSize = _win31->getFileSize(num);
+			if (sourceSize == 0 || _unpackCache->findData(num, sourceSize)) {
+				continue;
+			}
+			uint8_t *p = (uint8_t *)malloc(sourceSize);
+			if (p) {
+				uint32_t size = 0;
+				if (decodeDat(num, p, &size) == p) {
+					_unpackCache->addData(num, sourceSize, p, size);
+					++count;
+				}
+				free(p);
+			}
+		}
+		debug(DBG_RESOURCE, "Decoded %d entries to the cache", count);
+	} else if (build) {
+		int count = 0;
+		for (int i = 0; i < _numMemList; ++i) {
+			const MemEntry *me = &_memList[i];
+			if (me->bankNum == 0 || me->packedSize == me->unpackedSize || _unpackCache->find(me)) {
+				continue;
+			}
+			uint8_t *p = (uint8_t *)malloc(me->unpackedSize);
+			if (p) {
+				if (readBank(me, p)) {
+					++count;
+				}
+				free(p);
+			}
+		}
+		debug(DBG_RESOURCE, "Unpacked %d bank entries to the cache", count);
+	}
+}
+
+uint8_t *Resource::decodeDat(int num, uint8_t *dst, uint32_t *size) {
+	switch (_dataType) {
+	case DT_15TH_EDITION:
+	case DT_20TH_EDITION:
+		return _nth->loadDat(num, dst, size);
+	case DT_WIN31:
+		return _win31->loadFile(num, dst, size);
 	case DT_3DO:
-		p = _3do->loadFile(num, _scriptCurPtr, &size);
-		break;
+		return _3do->loadFile(num, dst, size);
 	default:
 		break;
 	}
+	return 0;
+}
+
+uint8_t *Resource::loadDat(int num, uint32_t *dataSize) {
+	assert(num < _numMemList);
+	MemEntry *me = &_memList[num];
+	if (me->status == STATUS_LOADED) {
+		return me->bufPtr;
+	}
+	uint32_t size = 0;
+	const uint8_t *prefetched = 0;
+	if (_prefetcher) {
+		if (_hdDatKey >= 0) {
+			prefetched = _prefetcher->find(kPrefetchHdDat, _hdDatKey, &size);
+		} else {
+			prefetched = _prefetcher->find((_dataType == DT_3DO) ? kPrefetchFile3do : kPrefetchDat, num, &size);
+		}
+	}
+	uint32_t maxSize = size;
+	if (!prefetched) {
+		switch (_dataType) {
+		case DT_15TH_EDITION:
+		case DT_20TH_EDITION:
+			maxSize = _nth->getDatSize(num);
+			break;
+		case DT_WIN31:
+			maxSize = _win31->getFileSize(num);
+			break;
+		case DT_3DO:
+			maxSize = _3do->getFileSize(num);
+			break;
+		default:
+			break;
+		}
+	}
+	uint8_t *dst = allocMem(maxSize, me->type);
+	if (!dst) {
+		return 0;
+	}
+	uint8_t *p = 0;
+	if (prefetched) {
+		memcpy(dst, prefetched, size);
+		p = dst;
+	} else if (isDatCached()) {
+		const UnpackCacheEntry *e = _unpackCache->findData(num, maxSize);
+		if (e && e->unpackedSize <= maxSize && _unpackCache->read(e, dst)) {
+			size = e->unpackedSize;
+			p = dst;
+		} else {
+			p = decodeDat(num, dst, &size);
+			if (p == dst) {
+				_unpackCache->addData(num, maxSize, dst, size);
+			}
+		}
+	} else {
+		p = decodeDat(num, dst, &size);
+	}
+	// the loaders may write less than the size of the file, or decode to another buffer
+	shrinkMem(dst, maxSize, (p == dst) ? size : 0, me->type);
 	if (p) {
-		_scriptCurPtr += size;
-		_memList[num].bufPtr = p;
-		_memList[num].status = STATUS_LOADED;
+		me->bufPtr = p;
+		me->status = STATUS_LOADED;
+		if (dataSize) {
+			*dataSize = size;
+		}
 	}
 	return p;
 }
@@ -549,18 +894,31 @@ uint8_t *Resource::loadWav(int num, int channel) {
 	uint32_t size = 0;
 	uint8_t *p = 0;
 	switch (_dataType) {
-	case DT_15TH_EDITION:
 	case DT_20TH_EDITION:
-		p = _nth->loadWav(num, _scriptCurPtr, &size, channel);
+		if (_prefetcher) {
+			// kept until the next part, the mixer is stopped before
+			p = (uint8_t *)_prefetcher->find(kPrefetchWav, num, &size);
+			if (p) {
+				return p;
+			}
+		}
+		/* fall-through */
+	case DT_15TH_EDITION:
+		p = _nth->loadWav(num, 0, &size, channel);
 		break;
-	case DT_WIN31:
-		p = _win31->loadFile(num, _scriptCurPtr, &size);
+	case DT_WIN31: {
+			const uint32_t maxSize = _win31->getFileSize(num);
+			uint8_t *dst = allocMem(maxSize, RT_SOUND);
+			if (dst) {
+				p = _win31->loadFile(num, dst, &size);
+				shrinkMem(dst, maxSize, p ? size : 0, RT_SOUND);
+			}
+		}
 		break;
 	default:
 		break;
 	}
 	if (p && size != 0) {
-		_scriptCurPtr += size;
 		_memList[num].bufPtr = p;
 		_memList[num].status = STATUS_LOADED;
 	}
@@ -620,6 +978,111 @@ const uint8_t Resource::_memListParts[][4] = {
 	{ 0x7D, 0x7E, 0x7F, 0x00 }  // 16009 - password screen
 };
 
+// bank2.mat is used by most of the parts
+static bool isSharedSegment(int num) {
+	int count = 0;
+	for (int i = 0; i <= kPartFinal - 16000; ++i) {
+		for (int j = 0; j < 4; ++j) {
+			if (Resource::_memListParts[i][j] == num) {
+				++count;
+			}
+		}
+	}
+	return count > 1;
+}
+
+bool Resource::isPinned(const MemEntry *me) const {
+	return me->status == STATUS_LOADED && me->bufPtr >= _pinnedPtr && me->bufPtr < _vidCurPtr;
+}
+
+void Resource::unpinAll() {
+	for (int i = 0; i < _numMemList; ++i) {
+		if (isPinned(&_memList[i])) {
+			_memList[i].status = STATUS_NULL;
+		}
+	}
+	_pinnedPtr = _vidCurPtr;
+}
+
+// loads the entry at the top of the memory block where invalidateAll() keeps it
+uint8_t *Resource::loadPinned(int num) {
+	MemEntry *me = &_memList[num];
+	if (me->status == STATUS_LOADED) {
+		return me->bufPtr;
+	}
+	uint8_t *start = _scriptCurPtr;
+	switch (_dataType) {
+	case DT_AMIGA:
+	case DT_ATARI:
+	case DT_ATARI_DEMO:
+	case DT_DOS:
+		me->status = STATUS_TOLOAD;
+		load();
+		break;
+	default:
+		loadDat(num);
+		break;
+	}
+	if (me->status == STATUS_LOADED && me->bufPtr == start) {
+		const uint32_t size = _scriptCurPtr - start;
+		debug(DBG_RESOURCE, "Pinning resource %d size %d", num, size);
+		_pinnedPtr -= size;
+		memmove(_pinnedPtr, start, size);
+		me->bufPtr = _pinnedPtr;
+		_scriptCurPtr = start;
+		_memUsage[me->type] -= size;
+	}
+	return me->bufPtr;
+}
+
+// the HD assets of the 20th anniversary edition are only used if present for all the segments of the part
+bool Resource::hasHdDats(int part) {
+	if (_dataType != DT_20TH_EDITION) {
+		return false;
+	}
+	for (int i = 0; i < 4; ++i) {
+		if (_memListParts[part][i] != 0 && _nth->getHdDatSize(part, i) == 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// returns false if a segment could not be loaded, the memory is not released
+bool Resource::loadSegments(int part, bool hdDats) {
+	if (hdDats != _pinnedHdDats) {
+		// the shared segment differs between the HD and the FILE%03d.DAT assets
+		unpinAll();
+		_pinnedHdDats = hdDats;
+	}
+	uint8_t **segments[4] = { &_segVideoPal, &_segCode, &_segVideo1, &_segVideo2 };
+	static const uint8_t types[4] = { RT_PALETTE, RT_BYTECODE, RT_SHAPE, RT_BANK };
+	for (int i = 0; i < 4; ++i) {
+		const int num = _memListParts[part][i];
+		if (num != 0) {
+			_memList[num].type = types[i];
+			if (hdDats) {
+				_nth->preloadDat(part, i, num);
+				_hdDatKey = part * 4 + i;
+			}
+			uint32_t size = 0;
+			*segments[i] = isSharedSegment(num) ? loadPinned(num) : loadDat(num, &size);
+			if (hdDats) {
+				// clears the name of the HD asset, loadDat may return before reading it
+				_nth->preloadDat(0, 0, 0);
+				_hdDatKey = -1;
+			}
+			if (_memList[num].status != STATUS_LOADED) {
+				return false;
+			}
+			if (i == 1) {
+				_segCodeSize = size;
+			}
+		}
+	}
+	return true;
+}
+
 void Resource::setupPart(int ptrId) {
 	int firstPart = kPartCopyProtection;
 	switch (_dataType) {
@@ -630,23 +1093,29 @@ void Resource::setupPart(int ptrId) {
 		/* fall-through */
 	case DT_WIN31:
 		if (ptrId >= firstPart && ptrId <= 16009) {
+			if (_prefetcher) {
+				_prefetcher->flush(ptrId == _stagedPart);
+				_stagedPart = 0;
+			}
+			const int part = ptrId - 16000;
+			bool hdDats = ResourceNth::_useHdDats && hasHdDats(part);
+			const uint32_t t0 = SDL_GetTicks();
 			invalidateAll();
-			uint8_t **segments[4] = { &_segVideoPal, &_segCode, &_segVideo1, &_segVideo2 };
-			for (int i = 0; i < 4; ++i) {
-				const int num = _memListParts[ptrId - 16000][i];
-				if (num != 0) {
-					if (_dataType == DT_20TH_EDITION && 0) {
-						// HD assets
-						_nth->preloadDat(ptrId - 16000, i, num);
-					}
-					*segments[i] = loadDat(num);
-				}
+			if (!loadSegments(part, hdDats) && hdDats) {
+				warning("Not enough memory for the HD assets of part %d", ptrId);
+				_currentPart = 0; // not recorded as the high-water mark of the previous part
+				invalidateAll();
+				hdDats = false;
+				loadSegments(part, hdDats);
 			}
+			debug(DBG_RESOURCE, "Part %d segments loaded from the %s files in %d ms", ptrId, hdDats ? "HD" : "FILE%03d.DAT", SDL_GetTicks() - t0);
 			_currentPart = ptrId;
+			prefetchPart();
 		} else {
 			error("Resource::setupPart() ec=0x%X invalid part", 0xF07);
 		}
 		_scriptBakPtr = _scriptCurPtr;
+		markMem();
 		break;
 	case DT_AMIGA:
 	case DT_ATARI:
@@ -666,13 +1135,17 @@ void Resource::setupPart(int ptrId) {
 			} else {
 				error("Resource::setupPart() ec=0x%X invalid part", 0xF07);
 			}
+			if (_prefetcher) {
+				_prefetcher->flush(ptrId == _stagedPart);
+				_stagedPart = 0;
+			}
 			invalidateAll();
+			if (ivd2 != 0) {
+				loadPinned(ivd2);
+			}
 			_memList[ipal].status = STATUS_TOLOAD;
 			_memList[icod].status = STATUS_TOLOAD;
 			_memList[ivd1].status = STATUS_TOLOAD;
-			if (ivd2 != 0) {
-				_memList[ivd2].status = STATUS_TOLOAD;
-			}
 			load();
 			_segVideoPal = _memList[ipal].bufPtr;
 			_segCode = _memList[icod].bufPtr;
@@ -680,25 +1153,225 @@ void Resource::setupPart(int ptrId) {
 			if (ivd2 != 0) {
 				_segVideo2 = _memList[ivd2].bufPtr;
 			}
+			_segCodeSize = _memList[icod].unpackedSize;
 			_currentPart = ptrId;
+			prefetchPart();
 		}
 		_scriptBakPtr = _scriptCurPtr;
+		markMem();
 		break;
 	}
 }
 
+void Resource::initPrefetcher() {
+	if (_dataType == DT_15TH_EDITION || _dataType == DT_WIN31) {
+		return;
+	}
+	_prefetcher = new Prefetcher;
+	if (!_prefetcher->init(prefetchResource, this)) {
+		delete _prefetcher;
+		_prefetcher = 0;
+	}
+}
+
+// queues the resources referenced by the part bytecode, the ones the scripts wait for first
+void Resource::prefetchPart() {
+	if (!_prefetcher || !_segCode) {
+		return;
+	}
+	PrefetchRes res[Prefetcher::kMaxJobs];
+	const int count = Prefetcher::findResources(_segCode, _segCodeSize, _dataType == DT_3DO, res, Prefetcher::kMaxJobs);
+	for (int pass = 0; pass < 2; ++pass) {
+		for (int i = 0; i < count; ++i) {
+			const bool update = (res[i].opcode == 0x19); // op_updateResources
+			if (update != (pass == 0)) {
+				continue;
+			}
+			const int num = res[i].num;
+			switch (_dataType) {
+			case DT_AMIGA:
+			case DT_ATARI:
+			case DT_ATARI_DEMO:
+			case DT_DOS:
+				if (num < _numMemList) {
+					const MemEntry *me = &_memList[num];
+					if (me->status == STATUS_NULL && me->bankNum != 0 && me->unpackedSize != 0 && !(_unpackCache && _unpackCache->find(me))) {
+						_prefetcher->queue(kPrefetchBank, num, me->unpackedSize);
+					}
+				}
+				break;
+			case DT_20TH_EDITION:
+				if (res[i].opcode == 0x18) { // op_playSound
+					_prefetcher->queue(kPrefetchWav, num, 0);
+				}
+				break;
+			case DT_3DO:
+				if (update && num >= 2000) {
+					const uint8_t *soundsList = getSoundsList3DO(num);
+					for (int j = 0; soundsList && soundsList[j] != 255; ++j) {
+						_prefetcher->queue(kPrefetchFile3do, soundsList[j], 0);
+					}
+				} else if (update && num >= 200) {
+					_prefetcher->queue(kPrefetchFile3do, num, 0);
+				}
+				break;
+			default:
+				break;
+			}
+		}
+	}
+	debug(DBG_RESOURCE, "Prefetching %d resources for part %d", count, _currentPart);
+	// the parts are played in order
+	if (_currentPart >= kPartCopyProtection && _currentPart < kPartFinal) {
+		stagePart(_currentPart + 1);
+	}
+	_prefetcher->start();
+}
+
+// queues the segments of the part after the current one, swapped in by setupPart()
+void Resource::stagePart(int part) {
+	for (int i = 0; i < 4; ++i) {
+		const int num = _memListParts[part - 16000][i];
+		if (num == 0) {
+			continue;
+		}
+		if (isPinned(&_memList[num])) {
+			continue;
+		}
+		switch (_dataType) {
+		case DT_AMIGA:
+		case DT_ATARI:
+		case DT_ATARI_DEMO:
+		case DT_DOS: {
+				const MemEntry *me = &_memList[num];
+				if (!(_unpackCache && _unpackCache->find(me))) {
+					_prefetcher->queue(kPrefetchBank, num, me->unpackedSize, true);
+				}
+			}
+			break;
+		case DT_20TH_EDITION:
+			if (ResourceNth::_useHdDats) {
+				// setupPart() falls back to FILE%03d.DAT if the HD assets are missing
+				_prefetcher->queue(kPrefetchHdDat, (part - 16000) * 4 + i, _nth->getHdDatSize(part - 16000, i), true);
+			} else {
+				_prefetcher->queue(kPrefetchDat, num, _nth->getDatSize(num), true);
+			}
+			break;
+		case DT_3DO:
+			_prefetcher->queue(kPrefetchFile3do, num, 0, true);
+			break;
+		default:
+			break;
+		}
+	}
+	_stagedPart = part;
+}
+
 void Resource::allocMemBlock() {
 	_memPtrStart = (uint8_t *)malloc(MEM_BLOCK_SIZE);
 	_scriptBakPtr = _scriptCurPtr = _memPtrStart;
 	_vidCurPtr = _memPtrStart + MEM_BLOCK_SIZE - (320 * 200 / 2); // 4bpp bitmap
+	_pinnedPtr = _vidCurPtr;
+	_memChunksCount = _memChunksBakCount = 0;
+	_memHighWater = 0;
 	_useSegVideo2 = false;
 }
 
 void Resource::freeMemBlock() {
+	for (int i = 0; i < 10; ++i) {
+		if (_partsHighWater[i] != 0) {
+			debug(DBG_RESOURCE, "Memory part %d high-water %d", 16000 + i, _partsHighWater[i]);
+		}
+	}
+	freeMemChunks(0);
 	free(_memPtrStart);
 	_memPtrStart = 0;
 }
 
+// bump allocation in the memory block, then in the chained chunks
+uint8_t *Resource::allocMem(uint32_t size, int type) {
+	uint8_t *p = 0;
+	if (size <= uint32_t(_pinnedPtr - _scriptCurPtr)) {
+		p = _scriptCurPtr;
+		_scriptCurPtr += size;
+	} else {
+		for (int i = 0; i < _memChunksCount && !p; ++i) {
+			MemChunk *c = &_memChunks[i];
+			if (size <= c->size - c->used) {
+				p = c->ptr + c->used;
+				c->used += size;
+			}
+		}
+		if (!p && _memChunksCount < MEM_CHUNKS_COUNT) {
+			MemChunk *c = &_memChunks[_memChunksCount];
+			c->size = MAX<uint32_t>(size, MEM_CHUNK_SIZE);
+			c->ptr = (uint8_t *)malloc(c->size);
+			if (c->ptr) {
+				debug(DBG_RESOURCE, "Resource::allocMem() chaining %d bytes for part %d", c->size, _currentPart);
+				c->used = size;
+				c->bakUsed = 0;
+				++_memChunksCount;
+				p = c->ptr;
+			}
+		}
+		if (!p) {
+			warning("Resource::allocMem() unable to allocate %d bytes", size);
+			return 0;
+		}
+	}
+	_memUsage[type] += size;
+	uint32_t total = (_scriptCurPtr - _memPtrStart) + (_vidCurPtr - _pinnedPtr);
+	for (int i = 0; i < _memChunksCount; ++i) {
+		total += _memChunks[i].used;
+	}
+	_memHighWater = MAX(_memHighWater, total);
+	return p;
+}
+
+// gives back the end of the last allocation
+void Resource::shrinkMem(uint8_t *p, uint32_t size, uint32_t usedSize, int type) {
+	if (p + size == _scriptCurPtr) {
+		_scriptCurPtr = p + usedSize;
+	} else {
+		for (int i = 0; i < _memChunksCount; ++i) {
+			MemChunk *c = &_memChunks[i];
+			if (p + size == c->ptr + c->used) {
+				c->used -= size - usedSize;
+				break;
+			}
+		}
+	}
+	_memUsage[type] -= size - usedSize;
+}
+
+void Resource::freeMemChunks(int count) {
+	for (int i = count; i < _memChunksCount; ++i) {
+		free(_memChunks[i].ptr);
+	}
+	if (_memChunksCount > count) {
+		_memChunksCount = count;
+	}
+}
+
+// the state restored by invalidateRes()
+void Resource::markMem() {
+	for (int i = 0; i < _memChunksCount; ++i) {
+		_memChunks[i].bakUsed = _memChunks[i].used;
+	}
+	_memChunksBakCount = _memChunksCount;
+	memcpy(_memUsageBak, _memUsage, sizeof(_memUsageBak));
+}
+
+void Resource::dumpMem() {
+	static const char *names[] = { "sound", "music", "bitmap", "palette", "bytecode", "shape", "bank" };
+	debug(DBG_RESOURCE, "Memory part %d high-water %d pinned %d chunks %d", _currentPart, _memHighWater, _vidCurPtr - _pinnedPtr, _memChunksCount);
+	for (int i = 0; i < MEM_TYPES_COUNT; ++i) {
+		if (_memUsage[i] != 0) {
+			debug(DBG_RESOURCE, "  %s %d", names[i], _memUsage[i]);
+		}
+	}
+}
+
 void Resource::readDemo3Joy() {
 	static const char *filename = "demo3.joy";
 	File f;
@@ -20,6 +20,12 @@ struct MemEntry {
 	uint32_t unpackedSize; // 0x12
 };
 
+struct MemChunk {
+	uint8_t *ptr;
+	uint32_t size;
+	uint32_t used, bakUsed;
+};
+
 struct AmigaMemEntry {
 	uint8_t type;
 	uint8_t bank;
@@ -59,6 +65,10 @@ struct DemoJoy {
 	}
 };
 
+struct BackgroundCache;
+struct Prefetcher;
+struct UnpackCache;
+struct File;
 struct ResourceNth;
 struct ResourceWin31;
 struct Resource3do;
@@ -91,10 +101,17 @@ struct Resource {
 
 	enum {
 		MEM_BLOCK_SIZE = 1 * 1024 * 1024,
+		MEM_CHUNK_SIZE = 256 * 1024, // chained when the block is exhausted
+		MEM_CHUNKS_COUNT = 8,
+		MEM_TYPES_COUNT = RT_BANK + 1,
 		ENTRIES_COUNT = 146,
 		ENTRIES_COUNT_20TH = 178,
 	};
 
+	enum {
+		BANK_FILES_COUNT = 16
+	};
+
 	enum {
 		STATUS_NULL,
 		STATUS_LOADED,
@@ -112,6 +129,12 @@ struct Resource {
 	uint16_t _numMemList;
 	uint16_t _currentPart, _nextPart;
 	uint8_t *_memPtrStart, *_scriptBakPtr, *_scriptCurPtr, *_vidCurPtr;
+	uint8_t *_pinnedPtr; // segments shared between parts, below the video buffer
+	MemChunk _memChunks[MEM_CHUNKS_COUNT];
+	int _memChunksCount, _memChunksBakCount;
+	uint32_t _memUsage[MEM_TYPES_COUNT], _memUsageBak[MEM_TYPES_COUNT]; // by ResType
+	uint32_t _memHighWater;
+	uint32_t _partsHighWater[10];
 	bool _useSegVideo2;
 	uint8_t *_segVideoPal;
 	uint8_t *_segCode;
@@ -121,11 +144,19 @@ struct Resource {
 	bool _hasPasswordScreen;
 	DataType _dataType;
 	ResourceNth *_nth;
+	BackgroundCache *_bgCache;
 	ResourceWin31 *_win31;
 	Resource3do *_3do;
 	Language _lang;
 	const AmigaMemEntry *_amigaMemList;
 	DemoJoy _demo3Joy;
+	File *_bankFiles[BANK_FILES_COUNT];
+	UnpackCache *_unpackCache;
+	Prefetcher *_prefetcher;
+	uint32_t _segCodeSize;
+	uint16_t _stagedPart;
+	int _hdDatKey; // prefetcher key of the HD asset being loaded, -1 for FILE%03d.DAT
+	bool _pinnedHdDats;
 
 	Resource(Video *vid, const char *dataDir);
 	~Resource();
@@ -133,6 +164,7 @@ struct Resource {
 	DataType getDataType() const { return _dataType; }
 	void detectVersion();
 	const char *getGameTitle(Language lang) const;
+	File *getBankFile(int bankNum);
 	bool readBank(const MemEntry *me, uint8_t *dstBuf);
 	void readEntries();
 	void readEntriesAmiga(const AmigaMemEntry *entries, int count);
@@ -142,15 +174,32 @@ struct Resource {
 	void invalidateRes();	
 	void update(uint16_t num, PreloadSoundProc, void *);
 	void loadBmp(int num);
-	uint8_t *loadDat(int num);
+	void initBackgroundCache(bool warm);
+	void initUnpackCache(bool build);
+	bool isDatCached() const;
+	void initPrefetcher();
+	void prefetchPart();
+	void stagePart(int part);
+	uint8_t *decodeDat(int num, uint8_t *dst, uint32_t *size);
+	uint8_t *loadDat(int num, uint32_t *size = 0);
 	void loadFont();
 	void loadHeads();
 	uint8_t *loadWav(int num, int channel);
 	const char *getString(int num);
 	const char *getMusicPath(int num, char *buf, int bufSize, uint32_t *offset = 0);
 	void setupPart(int part);
+	bool hasHdDats(int part);
+	bool loadSegments(int part, bool hdDats);
+	bool isPinned(const MemEntry *me) const;
+	uint8_t *loadPinned(int num);
+	void unpinAll();
 	void allocMemBlock();
 	void freeMemBlock();
+	uint8_t *allocMem(uint32_t size, int type);
+	void shrinkMem(uint8_t *p, uint32_t size, uint32_t usedSize, int type);
+	void freeMemChunks(int count);
+	void markMem();
+	void dumpMem();
 	void readDemo3Joy();
 };
 
@@ -209,6 +209,19 @@ bool Resource3do::readEntries() {
 	return true;
 }
 
+uint32_t Resource3do::getFileSize(int num) {
+	char name[16];
+	snprintf(name, sizeof(name), "File%d", num);
+	if (_iso) {
+		const OperaIsoEntry *e = _iso->find(name);
+		return e ? e->size : 0;
+	}
+	char path[MAXPATHLEN];
+	snprintf(path, sizeof(path), "%s/GameData/%s", _dataPath, name);
+	File f;
+	return f.open(path) ? f.size() : 0;
+}
+
 uint8_t *Resource3do::loadFile(int num, uint8_t *dst, uint32_t *size) {
 	uint8_t *in = dst;
 	if (_iso) {
@@ -274,6 +287,55 @@ uint8_t *Resource3do::loadFile(int num, uint8_t *dst, uint32_t *size) {
 	return dst;
 }
 
+// same as loadFile() with a buffer allocated with malloc, safe to call from another thread
+uint8_t *Resource3do::prefetchFile(int num, uint32_t *size) {
+	char name[16];
+	snprintf(name, sizeof(name), "File%d", num);
+	File f;
+	uint32_t offset = 0;
+	uint32_t dataSize = 0;
+	if (_iso) {
+		const OperaIsoEntry *e = _iso->find(name);
+		if (!e || !f.open(_dataPath)) {
+			return 0;
+		}
+		offset = e->offset;
+		dataSize = e->size;
+	} else {
+		char path[MAXPATHLEN];
+		snprintf(path, sizeof(path), "%s/GameData/%s", _dataPath, name);
+		if (!f.open(path)) {
+			return 0;
+		}
+		dataSize = f.size();
+	}
+	uint8_t *p = (uint8_t *)malloc(dataSize);
+	if (!p) {
+		return 0;
+	}
+	f.seek(offset);
+	if (f.read(p, dataSize) != (int)dataSize) {
+		free(p);
+		return 0;
+	}
+	*size = dataSize;
+	if (dataSize > 4 && memcmp(p, "\x00\xf4\x01\x00", 4) == 0) {
+		static const int SZ = 64000 * 2;
+		uint8_t *tmp = (uint8_t *)malloc(SZ);
+		const int decodedSize = tmp ? decodeLzss(p + 4, dataSize - 4, tmp) : 0;
+		free(p);
+		if (decodedSize != SZ) {
+			if (tmp) {
+				free(tmp);
+			}
+			return 0;
+		}
+		*size = decodedSize;
+		return tmp;
+	}
+	return p;
+}
+
 uint16_t *Resource3do::loadShape555(const char *name, int *w, int *h) {
 	if (_iso) {
 		const OperaIsoEntry *e = _iso->find(name);
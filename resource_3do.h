@@ -22,7 +22,9 @@ struct Resource3do {
 
 	bool readEntries();
 
+	uint32_t getFileSize(int num);
 	uint8_t *loadFile(int num, uint8_t *dst, uint32_t *size);
+	uint8_t *prefetchFile(int num, uint32_t *size);
 	uint16_t *loadShape555(const char *name, int *w, int *h);
 	const char *getMusicName(int num, uint32_t *offset);
 	const char *getCpak(const char *name, uint32_t *offset);
@@ -1,11 +1,16 @@
 
+#include <SDL.h>
 #include <time.h>
 #include <sys/stat.h>
 #include <zlib.h>
+#ifdef USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 #include "pak.h"
 #include "resource_nth.h"
 #include "util.h"
 #include "script.h"
+#include "wavcache.h"
 
 static uint8_t *_background_data_ptr;
 static uint32_t _background_data_ptr_size = 0;
@@ -24,6 +29,13 @@ static WavBuffer _wav_buffers[WAV_BUFFER_CHANNEL_COUNT] = {
 	{nullptr, 0}
 };
 
+// the pooled buffers grow by steps to avoid reallocating for slightly larger files
+static uint32_t getPoolSize(uint32_t size)
+{
+	static const uint32_t kPoolGranularity = 16 * 1024;
+	return (size + kPoolGranularity - 1) & ~(kPoolGranularity - 1);
+}
+
 static uint8_t *getWavBuffer(int channel, size_t size)
 {
 	assert(channel < WAV_BUFFER_CHANNEL_COUNT);
@@ -34,9 +46,10 @@ static uint8_t *getWavBuffer(int channel, size_t size)
 			debug(DBG_INFO, "Freeing %ld bytes from wav channel %d.", _wav_buffers[channel].buffer_size, channel);
 			free(_wav_buffers[channel].buffer);
 		}
+		size = getPoolSize(size);
 		debug(DBG_INFO, "Allocating %ld bytes to wav channel %d.", size, channel);
 		_wav_buffers[channel].buffer = (uint8_t *)malloc(size);
-		_wav_buffers[channel].buffer_size = size;
+		_wav_buffers[channel].buffer_size = _wav_buffers[channel].buffer ? size : 0;
 	}
 	return _wav_buffers[channel].buffer;
 }
@@ -135,6 +148,13 @@ struct Resource15th: ResourceNth {
 		return load(name);
 	}
 
+	virtual uint32_t getDatSize(int num) {
+		char name[16];
+		snprintf(name, sizeof(name), "file%03d.dat", num);
+		const PakEntry *e = _pak.find(name);
+		return e ? e->size : 0;
+	}
+
 	virtual uint8_t *loadDat(int num, uint8_t *dst, uint32_t *size) {
 		char name[16];
 		snprintf(name, sizeof(name), "file%03d.dat", num);
@@ -336,67 +356,142 @@ static void setBackgroundDataPtr(uint32_t size)
 	}
 }
 
-static uint8_t *inflateGzip(const char *filepath, int gzip_type, int channel) {
+// the compressed file is read at once and inflated with a single call
+static bool inflateBuffer(const uint8_t *in, uint32_t inSize, uint8_t *out, uint32_t outSize) {
+#ifdef USE_LIBDEFLATE
+	libdeflate_decompressor *d = libdeflate_alloc_decompressor();
+	if (!d) {
+		return false;
+	}
+	size_t count = 0;
+	const libdeflate_result ret = libdeflate_gzip_decompress(d, in, inSize, out, outSize, &count);
+	libdeflate_free_decompressor(d);
+	return ret == LIBDEFLATE_SUCCESS && count == outSize;
+#else
+	z_stream str;
+	memset(&str, 0, sizeof(str));
+	if (inflateInit2(&str, MAX_WBITS + 16) != Z_OK) {
+		return false;
+	}
+	str.next_in = (Bytef *)in;
+	str.avail_in = inSize;
+	str.next_out = out;
+	str.avail_out = outSize;
+	const int err = inflate(&str, Z_FINISH);
+	inflateEnd(&str);
+	return err == Z_STREAM_END && str.avail_out == 0;
+#endif
+}
+
+// compressed data, one buffer for the main thread and one for the prefetcher thread
+struct GzipInputBuffer {
+	SDL_atomic_t busy;
+	uint8_t *buffer;
+	uint32_t buffer_size;
+};
+
+#define GZIP_INPUT_BUFFER_COUNT	2
+
+static GzipInputBuffer _gzip_input_buffers[GZIP_INPUT_BUFFER_COUNT];
+
+static uint8_t *getGzipInputBuffer(uint32_t size, int *slot)
+{
+	for (int i = 0; i < GZIP_INPUT_BUFFER_COUNT; ++i) {
+		GzipInputBuffer *b = &_gzip_input_buffers[i];
+		if (!SDL_AtomicCAS(&b->busy, 0, 1)) {
+			continue;
+		}
+		if (b->buffer_size < size) {
+			if (b->buffer) {
+				free(b->buffer);
+			}
+			b->buffer_size = getPoolSize(size);
+			b->buffer = (uint8_t *)malloc(b->buffer_size);
+			if (!b->buffer) {
+				b->buffer_size = 0;
+				SDL_AtomicSet(&b->busy, 0);
+				return 0;
+			}
+		}
+		*slot = i;
+		return b->buffer;
+	}
+	// both buffers are in use
+	*slot = -1;
+	return (uint8_t *)malloc(size);
+}
+
+static void releaseGzipInputBuffer(uint8_t *in, int slot)
+{
+	if (slot < 0) {
+		free(in);
+	} else {
+		SDL_AtomicSet(&_gzip_input_buffers[slot].busy, 0);
+	}
+}
+
+// reads the whole compressed file, dataSize is set from the ISIZE trailer
+static uint8_t *readGzipInput(const char *filepath, uint32_t *inSize, uint32_t *dataSize, int *slot) {
 	File f;
 	if (!f.open(filepath)) {
 		warning("Unable to open '%s'", filepath);
 		return 0;
 	}
-	const uint16_t sig = f.readUint16LE();
-	if (sig != 0x8B1F) {
-		warning("Unexpected file signature 0x%x for '%s'", sig, filepath);
+	const uint32_t fileSize = f.size();
+	if (fileSize < 18) { // header and trailer
+		warning("Unexpected file size %d for '%s'", fileSize, filepath);
 		return 0;
 	}
-	f.seek(-4, SEEK_END);
-	const uint32_t dataSize = f.readUint32LE();
+	uint8_t *in = getGzipInputBuffer(fileSize, slot);
+	if (!in) {
+		warning("Failed to allocate %d bytes (inflateGzip)", fileSize);
+		return 0;
+	}
+	if (f.read(in, fileSize) != (int)fileSize) {
+		warning("Failed to read '%s'", filepath);
+	} else if (READ_LE_UINT16(in) != 0x8B1F) {
+		warning("Unexpected file signature 0x%x for '%s'", READ_LE_UINT16(in), filepath);
+	} else {
+		*inSize = fileSize;
+		*dataSize = READ_LE_UINT32(in + fileSize - 4);
+		return in;
+	}
+	releaseGzipInputBuffer(in, *slot);
+	return 0;
+}
 
+// the GZIP_TYPE_OTHER data is allocated with malloc and owned by the caller
+static uint8_t *inflateGzip(const char *filepath, int gzip_type, uint32_t *outSize = 0) {
+	uint32_t inSize, dataSize;
+	int slot;
+	uint8_t *in = readGzipInput(filepath, &inSize, &dataSize, &slot);
+	if (!in) {
+		return 0;
+	}
 	uint8_t *out = nullptr;
-
 	if (gzip_type == GZIP_TYPE_BACKGROUND_IMAGE)
 	{
 		setBackgroundDataPtr(dataSize);
 		out = _background_data_ptr;
 	}
-	else if (gzip_type == GZIP_TYPE_WAV)
-	{		
-		out = getWavBuffer(channel, dataSize);
-	}
 	else
 	{
 		out = (uint8_t *)malloc(dataSize);
 	}
-	
 	if (!out) {
 		warning("Failed to allocate %d bytes (inflateGzip)", dataSize);
-		return 0;
-	}
-	f.seek(0);
-	z_stream str;
-	memset(&str, 0, sizeof(str));
-	int err = inflateInit2(&str, MAX_WBITS + 16);
-	if (err == Z_OK) {
-		Bytef buf[1 << MAX_WBITS];
-		str.next_in = buf;
-		str.avail_in = 0;
-		str.next_out = out;
-		str.avail_out = dataSize;
-		while (err == Z_OK && str.avail_out != 0) {
-			if (str.avail_in == 0 && !f.ioErr()) {
-				str.next_in = buf;
-				str.avail_in = f.read(buf, sizeof(buf));
-			}
-			err = inflate(&str, Z_NO_FLUSH);
-		}
-		inflateEnd(&str);
-		if (err == Z_STREAM_END) {
-			return out;
+	} else if (!inflateBuffer(in, inSize, out, dataSize)) {
+		warning("Failed to inflate '%s'", filepath);
+		if (gzip_type != GZIP_TYPE_BACKGROUND_IMAGE) {
+			free(out);
 		}
+		out = nullptr;
 	}
-	if (gzip_type != GZIP_TYPE_BACKGROUND_IMAGE)
-	{
-		free(out);
+	releaseGzipInputBuffer(in, slot);
+	if (out && outSize) {
+		*outSize = dataSize;
 	}
-	return 0;
+	return out;
 }
 
 static uint8_t *loadBackgroundBMPFile(const char *filepath)
@@ -449,6 +544,7 @@ struct Resource20th: ResourceNth {
 	char _musicName[64];
 	uint8_t _musicType;
 	char _datName[32];
+	WavCache _wavCache;
 	const char *_bitmapSize;
 	bool _useBMPinsteadOfBGZ;
 
@@ -534,7 +630,7 @@ struct Resource20th: ResourceNth {
 			else
 			{				
 				snprintf(path, sizeof(path), "%s/game/BGZ/Font.bgz", _dataPath);
-				return inflateGzip(path, GZIP_TYPE_OTHER, -1);
+				return inflateGzip(path, GZIP_TYPE_OTHER);
 			}
 		} else if (strcmp(name, "heads.bmp") == 0) {
 			char path[MAXPATHLEN];
@@ -546,35 +642,42 @@ struct Resource20th: ResourceNth {
 			else
 			{
 				snprintf(path, sizeof(path), "%s/game/BGZ/Heads.bgz", _dataPath);
-				return inflateGzip(path, GZIP_TYPE_OTHER, -1);
+				return inflateGzip(path, GZIP_TYPE_OTHER);
 			}
 		}
 		return 0;
 	}
 
-	virtual uint8_t *loadBmp(int num) {
-		char path[MAXPATHLEN];
+	virtual const char *getBmpPath(int num, char *path, int pathSize) {
 		if (_useBMPinsteadOfBGZ)
 		{
 			if (num >= 3000 && _bitmapSize) {
-				snprintf(path, sizeof(path), "%s/game/BMP/data%s/e%04d.bmp", _dataPath, _bitmapSize, num);
+				snprintf(path, pathSize, "%s/game/BMP/data%s/e%04d.bmp", _dataPath, _bitmapSize, num);
 			} else {
-				snprintf(path, sizeof(path), "%s/game/BMP/file%03d.bmp", _dataPath, num);
+				snprintf(path, pathSize, "%s/game/BMP/file%03d.bmp", _dataPath, num);
 			}
-			return loadBackgroundBMPFile(path);
 		}
 		else
 		{
 			if (num >= 3000 && _bitmapSize) {
-				snprintf(path, sizeof(path), "%s/game/BGZ/data%s/%s_e%04d.bgz", _dataPath, _bitmapSize, _bitmapSize, num);
+				snprintf(path, pathSize, "%s/game/BGZ/data%s/%s_e%04d.bgz", _dataPath, _bitmapSize, _bitmapSize, num);
 			} else {
-				snprintf(path, sizeof(path), "%s/game/BGZ/file%03d.bgz", _dataPath, num);
+				snprintf(path, pathSize, "%s/game/BGZ/file%03d.bgz", _dataPath, num);
 			}
-			return inflateGzip(path, GZIP_TYPE_BACKGROUND_IMAGE, -1);
 		}
+		return path;
 	}
 
-	void preloadDat(int part, int type, int num) {
+	virtual uint8_t *loadBmp(int num) {
+		char path[MAXPATHLEN];
+		getBmpPath(num, path, sizeof(path));
+		if (_useBMPinsteadOfBGZ) {
+			return loadBackgroundBMPFile(path);
+		}
+		return inflateGzip(path, GZIP_TYPE_BACKGROUND_IMAGE);
+	}
+
+	static bool getHdDatName(int part, int type, char *name, int nameSize) {
 		static const char *names[] = {
 			"INTRO", "EAU", "PRI", "CITE", "arene", "LUXE", "FINAL", 0
 		};
@@ -583,16 +686,95 @@ struct Resource20th: ResourceNth {
 		};
 		if (part > 0 && part < 8) {
 			if (type == 3) {
-				assert(num == 0x11);
-				strcpy(_datName, "BANK2.MAT");
+				snprintf(name, nameSize, "BANK2.MAT");
 			} else {
-				snprintf(_datName, sizeof(_datName), "%s2011.%s", names[part - 1], exts[type]);
+				snprintf(name, nameSize, "%s2011.%s", names[part - 1], exts[type]);
 			}
+			return true;
+		}
+		return false;
+	}
+
+	void preloadDat(int part, int type, int num) {
+		if (getHdDatName(part, type, _datName, sizeof(_datName))) {
+			assert(type != 3 || num == 0x11);
 			debug(DBG_RESOURCE, "Loading '%s'", _datName);
 		} else {
 			_datName[0] = 0;
 		}
-        }
+	}
+
+	// the PSP I/O driver blocks the calling thread for the whole request, smaller
+	// requests let the mixer and the music streamer be scheduled in between
+	static uint32_t readDatChunks(File &f, uint8_t *dst, uint32_t size) {
+		static const uint32_t kChunkSize = 64 * 1024;
+		uint32_t count = 0;
+		while (count < size) {
+			const uint32_t len = MIN(size - count, kChunkSize);
+			if (f.read(dst + count, len) != (int)len) {
+				break;
+			}
+			count += len;
+		}
+		return count;
+	}
+
+	uint8_t *readDat(const char *name, uint32_t *size) {
+		char path[MAXPATHLEN];
+		snprintf(path, sizeof(path), "%s/game/DAT", _dataPath);
+		File f;
+		if (!f.open(name, path)) {
+			return 0;
+		}
+		const uint32_t dataSize = f.size();
+		uint8_t *p = (uint8_t *)malloc(dataSize);
+		if (!p) {
+			return 0;
+		}
+		if (readDatChunks(f, p, dataSize) != dataSize) {
+			free(p);
+			return 0;
+		}
+		*size = dataSize;
+		return p;
+	}
+
+	virtual uint8_t *prefetchDat(int num, uint32_t *size) {
+		char name[16];
+		snprintf(name, sizeof(name), "FILE%03d.DAT", num);
+		return readDat(name, size);
+	}
+
+	virtual uint32_t getHdDatSize(int part, int type) {
+		char name[32];
+		if (!getHdDatName(part, type, name, sizeof(name))) {
+			return 0;
+		}
+		char path[MAXPATHLEN];
+		snprintf(path, sizeof(path), "%s/game/DAT", _dataPath);
+		File f;
+		return f.open(name, path) ? f.size() : 0;
+	}
+
+	virtual uint8_t *prefetchHdDat(int part, int type, uint32_t *size) {
+		char name[32];
+		if (!getHdDatName(part, type, name, sizeof(name))) {
+			return 0;
+		}
+		return readDat(name, size);
+	}
+
+	virtual uint32_t getDatSize(int num) {
+		char path[MAXPATHLEN];
+		snprintf(path, sizeof(path), "%s/game/DAT", _dataPath);
+		File f;
+		if (_datName[0] && f.open(_datName, path)) {
+			return f.size();
+		}
+		char name[16];
+		snprintf(name, sizeof(name), "FILE%03d.DAT", num);
+		return f.open(name, path) ? f.size() : 0;
+	}
 
 	virtual uint8_t *loadDat(int num, uint8_t *dst, uint32_t *size) {
 		bool datOpen = false;
@@ -608,7 +790,7 @@ struct Resource20th: ResourceNth {
 		}
 		if (datOpen) {
 			const uint32_t dataSize = f.size();
-			const uint32_t count = f.read(dst, dataSize);
+			const uint32_t count = readDatChunks(f, dst, dataSize);
 			if (count != dataSize) {
 				warning("Failed to read %d bytes (expected %d)", dataSize, count);
 			}
@@ -621,16 +803,65 @@ struct Resource20th: ResourceNth {
 		return dst;
 	}
 
+	void getWavPath(int num, char *path, int pathSize) {
+		const char *dir = Script::_useRemasteredAudio ? "" : "original/";
+		snprintf(path, pathSize, "%s/game/WGZ/%sfile%03d.wgz", _dataPath, dir, num);
+		struct stat s;
+		if (stat(path, &s) != 0) {
+			snprintf(path, pathSize, "%s/game/WGZ/%sfile%03dB.wgz", _dataPath, dir, num);
+		}
+	}
+
+	virtual uint8_t *prefetchWav(int num, uint32_t *size) {
+		if (Script::_useRemasteredAudio && (num == 81 || num == 85 || num == 96 || num == 163)) {
+			// the variant is picked when the sound is played
+			return 0;
+		}
+		char path[MAXPATHLEN];
+		getWavPath(num, path, sizeof(path));
+		return inflateGzip(path, GZIP_TYPE_OTHER, size);
+	}
+
+	virtual void setMixer(Mixer *mix) {
+		_wavCache._mix = mix;
+	}
+
+	uint8_t *loadCachedWav(const char *path, int channel) {
+		uint32_t dataSize = 0;
+		const uint8_t *p = _wavCache.find(path, channel, &dataSize);
+		if (p) {
+			return (uint8_t *)p;
+		}
+		uint32_t inSize;
+		int slot;
+		uint8_t *in = readGzipInput(path, &inSize, &dataSize, &slot);
+		if (!in) {
+			return 0;
+		}
+		uint32_t capacity = 0;
+		uint8_t *data = _wavCache.allocData(path, channel, dataSize, &capacity);
+		// too large for the cache, or all the entries are being played
+		uint8_t *buf = data ? data : getWavBuffer(channel, dataSize);
+		if (buf && !inflateBuffer(in, inSize, buf, dataSize)) {
+			warning("Failed to inflate '%s'", path);
+			if (data) {
+				free(data);
+			}
+			buf = data = 0;
+		}
+		releaseGzipInputBuffer(in, slot);
+		if (data) {
+			_wavCache.add(path, channel, data, dataSize, capacity);
+		}
+		return buf;
+	}
+
 	virtual uint8_t *loadWav(int num, uint8_t *dst, uint32_t *size, int channel) {
 		char path[MAXPATHLEN];
 		if (!Script::_useRemasteredAudio) {
-			snprintf(path, sizeof(path), "%s/game/WGZ/original/file%03d.wgz", _dataPath, num);
-			struct stat s;
-			if (stat(path, &s) != 0) {
-				snprintf(path, sizeof(path), "%s/game/WGZ/original/file%03dB.wgz", _dataPath, num);
-			}
+			getWavPath(num, path, sizeof(path));
 			*size = 0;
-			return inflateGzip(path, GZIP_TYPE_WAV, channel);
+			return loadCachedWav(path, channel);
 		}
 		switch (num) {
 		case 81: {
@@ -668,17 +899,12 @@ struct Resource20th: ResourceNth {
 				snprintf(path, sizeof(path), "%s/game/WGZ/file163-%s-1.wgz", _dataPath, snd);
 			}
 			break;
-		default: {
-				snprintf(path, sizeof(path), "%s/game/WGZ/file%03d.wgz", _dataPath, num);
-				struct stat s;
-				if (stat(path, &s) != 0) {
-					snprintf(path, sizeof(path), "%s/game/WGZ/file%03dB.wgz", _dataPath, num);
-				}
-			}
+		default:
+			getWavPath(num, path, sizeof(path));
 			break;
 		}
 		*size = 0;
-		return inflateGzip(path, GZIP_TYPE_WAV, channel);
+		return loadCachedWav(path, channel);
 	}
 
 	void loadStrings(Language lang) {
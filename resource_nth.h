@@ -4,16 +4,27 @@
 
 #include "intern.h"
 
+struct Mixer;
+
 struct ResourceNth {
+	static bool _useHdDats;
+
 	virtual ~ResourceNth() {
 	}
 
 	virtual bool init() = 0;
 	virtual uint8_t *load(const char *name) = 0;
 	virtual uint8_t *loadBmp(int num) = 0;
+	virtual const char *getBmpPath(int num, char *buf, int bufSize) { return 0; }
 	virtual void preloadDat(int part, int type, int num) {}
+	virtual uint32_t getDatSize(int num) = 0; // upper bound of the size written by loadDat
 	virtual uint8_t *loadDat(int num, uint8_t *dst, uint32_t *size) = 0;
+	virtual uint8_t *prefetchDat(int num, uint32_t *size) { return 0; } // thread safe, allocated with malloc
+	virtual uint32_t getHdDatSize(int part, int type) { return 0; } // 0 if the part has no HD asset
+	virtual uint8_t *prefetchHdDat(int part, int type, uint32_t *size) { return 0; } // thread safe, allocated with malloc
 	virtual uint8_t *loadWav(int num, uint8_t *dst, uint32_t *size, int channel) = 0;
+	virtual uint8_t *prefetchWav(int num, uint32_t *size) { return 0; } // thread safe, allocated with malloc
+	virtual void setMixer(Mixer *mix) {}
 	virtual const char *getString(Language lang, int num) = 0;
 	virtual const char *getMusicName(int num) = 0;
 	virtual void getBitmapSize(int *w, int *h) = 0;
@@ -264,6 +264,10 @@ bool ResourceWin31::readEntries() {
 	return _entries != 0;
 }
 
+uint32_t ResourceWin31::getFileSize(int num) const {
+	return (num > 0 && num < _entriesCount) ? _entries[num].size : 0;
+}
+
 uint8_t *ResourceWin31::loadFile(int num, uint8_t *dst, uint32_t *size) {
 	if (num > 0 && num < _entriesCount) {
 		Win31BankEntry *e = &_entries[num];
@@ -27,6 +27,7 @@ struct ResourceWin31 {
 	~ResourceWin31();
 
 	bool readEntries();
+	uint32_t getFileSize(int num) const;
 	uint8_t *loadFile(int num, uint8_t *dst, uint32_t *size);
 	void readStrings();
 	const char *getString(int num) const;
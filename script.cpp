@@ -22,7 +22,6 @@ Script::Script(Mixer *mix, Resource *res, SfxPlayer *ply, Video *vid)
 void Script::init() {
 	memset(_scriptVars, 0, sizeof(_scriptVars));
 	_fastMode = false;
-	_ply->_syncVar = &_scriptVars[VAR_MUSIC_SYNC];
 	_scriptPtr.byteSwap = _is3DO = (_res->getDataType() == Resource::DT_3DO);
 	if (_is3DO) {
 		_scriptVars[0xDB] = 1;
@@ -285,6 +284,9 @@ void Script::op_updateDisplay() {
 		}
 	}
 	_timeStamp = _stub->getTimeStamp();
+	if (SfxPlayer::_lockstep) {
+		_mix->advanceSfxMusic(_scriptVars[VAR_PAUSE_SLICES] * 1000 / frameHz);
+	}
 	if (_is3DO) {
 		_scriptVars[0xF7] = (_timeStamp - _startTime) * frameHz / 1000;
 	} else {
@@ -422,6 +424,12 @@ void Script::setupTasks() {
 		restartAt(_res->_nextPart);
 		_res->_nextPart = 0;
 	}
+	// music sync markers are only visible to the script between frames
+	SfxSyncEvent ev;
+	while (_ply->popSyncEvent(&ev)) {
+		debug(DBG_SND, "Script::setupTasks() VAR_MUSIC_SYNC = 0x%X (sample %d)", ev.value, ev.samplePos);
+		_scriptVars[VAR_MUSIC_SYNC] = ev.value;
+	}
 	for (int i = 0; i < 0x40; ++i) {
 		_scriptStates[0][i] = _scriptStates[1][i];
 		uint16_t n = _scriptTasks[1][i];
@@ -833,7 +841,7 @@ void Script::snd_playMusic(uint16_t resNum, uint16_t delay, uint8_t pos) {
 			_ply->start();
 			_mix->playSfxMusic(resNum);
 		} else if (delay != 0) {
-			_ply->setEventsDelay(delay);
+			_mix->setSfxMusicDelay(delay);
 		} else {
 			_mix->stopSfxMusic();
 		}
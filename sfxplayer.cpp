@@ -11,13 +11,35 @@
 #include "util.h"
 
 SfxPlayer::SfxPlayer(Resource *res)
-	: _res(res), _delay(0) {
+	: _res(res), _delay(0), _rate(0), _samplesLeft(0), _samplesPlayed(0), _syncEventsDropped(0),
+	_prerenderBuf(0), _prerenderSize(0), _prerenderThread(0), _prerenderState(0), _usePrerender(false), _prerenderGen(0), _isRenderCopy(false),
+	_lockstepState(0), _lockstepParent(0), _channelsChanged(0), _channelsVolume(0) {
 	_playing = false;
+	memset(_channels, 0, sizeof(_channels));
+	SDL_AtomicSet(&_syncEventsRead, 0);
+	SDL_AtomicSet(&_syncEventsWrite, 0);
+	SDL_AtomicSet(&_prerenderedFrames, 0);
+	SDL_AtomicSet(&_prerenderReadFrames, 0);
+	SDL_AtomicSet(&_prerenderCancel, 0);
+	SDL_AtomicSet(&_prerenderResetGen, 0);
+}
+
+SfxPlayer::~SfxPlayer() {
+	if (!_isRenderCopy) {
+		stopPrerender();
+		delete _prerenderState;
+		delete _lockstepState;
+		if (_prerenderBuf) {
+			free(_prerenderBuf);
+		}
+	}
 }
 
 void SfxPlayer::setEventsDelay(uint16_t delay) {
 	debug(DBG_SND, "SfxPlayer::setEventsDelay(%d)", delay);
 	_delay = delay;
+	// the samples rendered ahead used the previous tempo, called from the audio callback
+	_usePrerender = false;
 }
 
 void SfxPlayer::loadSfxModule(uint16_t resNum, uint16_t delay, uint8_t pos) {
@@ -65,71 +87,241 @@ void SfxPlayer::play(int rate) {
 	_playing = true;
 	_rate = rate;
 	_samplesLeft = 0;
+	_samplesPlayed = 0;
 	memset(_channels, 0, sizeof(_channels));
+	// only use the samples rendered for this module, see resetPrerender()
+	_usePrerender = false;
 }
 
-static int16_t toS16(int a) {
-	if (a <= -128) {
-		return -32768;
-	} else if (a >= 127) {
-		return 32767;
-	} else {
-		const uint8_t u8 = (a ^ 0x80);
-		return ((u8 << 8) | u8) - 32768;
-	}
+int SfxPlayer::getSamplesPerTick() const {
+	return _rate * (_delay * 60 * 1000 / kPaulaFreq) / 1000;
 }
 
-static void mixChannel(int16_t &s, SfxChannel *ch) {
-	if (ch->sampleLen == 0) {
-		return;
+void SfxPlayer::mixSamples(int32_t *buf, int len, bool mix) {
+	while (len != 0) {
+		int count = len;
+		if (!_lockstep) { // the events are otherwise handled by advanceLockstep
+			if (_samplesLeft == 0) {
+				handleEvents();
+				_samplesLeft = getSamplesPerTick();
+			}
+			if (count > _samplesLeft) {
+				count = _samplesLeft;
+			}
+			_samplesLeft -= count;
+		}
+		len -= count;
+		_samplesPlayed += count;
+		if (mix) {
+			_channels[0].mixSamples<true>(buf, count);
+			_channels[3].mixSamples<true>(buf, count);
+			_channels[1].mixSamples<true>(buf + 1, count);
+			_channels[2].mixSamples<true>(buf + 1, count);
+		} else {
+			for (int i = 0; i < NUM_CHANNELS; ++i) {
+				_channels[i].mixSamples<false>(buf, count);
+			}
+		}
+		buf += count * 2;
 	}
-	int pos1 = ch->pos.offset >> Frac::BITS;
-	ch->pos.offset += ch->pos.inc;
-	int pos2 = pos1 + 1;
-	if (ch->sampleLoopLen != 0) {
-		if (pos1 >= ch->sampleLoopPos + ch->sampleLoopLen - 1) {
-			pos2 = ch->sampleLoopPos;
-			ch->pos.offset = pos2 << Frac::BITS;
+}
+
+void SfxPlayer::readSamples(int32_t *buf, int len) {
+	if (_delay != 0) {
+		if (_usePrerender && !_lockstep && (uint32_t)SDL_AtomicGet(&_prerenderedFrames) >= _samplesPlayed + len / 2) {
+			SDL_MemoryBarrierAcquire();
+			uint32_t pos = _samplesPlayed % _prerenderSize;
+			for (int i = 0; i < len; i += 2) {
+				buf[i] += _prerenderBuf[pos * 2];
+				buf[i + 1] += _prerenderBuf[pos * 2 + 1];
+				if (++pos == _prerenderSize) {
+					pos = 0;
+				}
+			}
+			mixSamples(buf, len / 2, false);
+		} else {
+			mixSamples(buf, len / 2);
 		}
-	} else {
-		if (pos1 >= ch->sampleLen - 1) {
-			ch->sampleLen = 0;
-			return;
+		if (_usePrerender) {
+			// the frames before can be overwritten by the render thread
+			SDL_AtomicSet(&_prerenderReadFrames, _samplesPlayed);
 		}
 	}
-	int sample = ch->pos.interpolate((int8_t)ch->sampleData[pos1], (int8_t)ch->sampleData[pos2]);
-	sample = s + toS16(sample * ch->volume / 64);
-	s = (sample < -32768 ? -32768 : (sample > 32767 ? 32767 : sample));
 }
 
-void SfxPlayer::mixSamples(int16_t *buf, int len) {
-	while (len != 0) {
-		if (_samplesLeft == 0) {
-			handleEvents();
-			const int samplesPerTick = _rate * (_delay * 60 * 1000 / kPaulaFreq) / 1000;
-			_samplesLeft = samplesPerTick;
+// returns the generation to pass to resetPrerender(), 0 if the module is not rendered ahead
+int SfxPlayer::startPrerender(int rate) {
+	stopPrerender();
+	if (!_prerender || _lockstep || _delay == 0) {
+		return 0;
+	}
+	if (!_prerenderBuf) {
+		// allocated once, the audio callback may still be reading the previous module
+		_prerenderSize = PRERENDER_SECONDS * rate;
+		_prerenderBuf = (int16_t *)malloc(_prerenderSize * 2 * sizeof(int16_t));
+		if (!_prerenderBuf) {
+			warning("Failed to allocate %d bytes (SfxPlayer prerender)", _prerenderSize * 2 * sizeof(int16_t));
+			return 0;
+		}
+	}
+	if (!_prerenderState) {
+		_prerenderState = new SfxPlayer(_res);
+		_prerenderState->_isRenderCopy = true;
+	}
+	// only the sequencer state, the channels are reset by play()
+	_prerenderState->_delay = _delay;
+	_prerenderState->_sfxMod = _sfxMod;
+	_prerenderState->play(rate);
+	++_prerenderGen;
+	SDL_AtomicSet(&_prerenderCancel, 0);
+	_prerenderThread = SDL_CreateThread(prerenderThread, "SfxPrerender", this);
+	if (!_prerenderThread) {
+		warning("Unable to create sfx prerender thread");
+		return 0;
+	}
+	return _prerenderGen;
+}
+
+// called from the audio callback after play(), the ring buffer still holds the samples
+// of the previous module until then
+void SfxPlayer::resetPrerender(int gen) {
+	if (gen != 0) {
+		SDL_AtomicSet(&_prerenderedFrames, 0);
+		SDL_AtomicSet(&_prerenderReadFrames, 0);
+		_usePrerender = true;
+		SDL_AtomicSet(&_prerenderResetGen, gen);
+	}
+}
+
+void SfxPlayer::stopPrerender() {
+	if (_prerenderThread) {
+		SDL_AtomicSet(&_prerenderCancel, 1);
+		SDL_WaitThread(_prerenderThread, 0);
+		_prerenderThread = 0;
+	}
+}
+
+int SfxPlayer::prerenderThread(void *data) {
+	SfxPlayer *p = (SfxPlayer *)data;
+	SfxPlayer *state = p->_prerenderState;
+	const int gen = p->_prerenderGen;
+	const uint32_t startTicks = SDL_GetTicks();
+	static int32_t buf[PRERENDER_CHUNK * 2];
+	uint32_t frames = 0;
+	while (!SDL_AtomicGet(&p->_prerenderCancel) && state->_playing) {
+		if (SDL_AtomicGet(&p->_prerenderResetGen) != gen) {
+			SDL_Delay(1); // the audio callback has not started the module yet
+			continue;
 		}
-		int count = _samplesLeft;
-		if (count > len) {
-			count = len;
+		const int ahead = (int32_t)(frames - SDL_AtomicGet(&p->_prerenderReadFrames));
+		if (ahead >= (int)p->_prerenderSize) {
+			SDL_Delay(10); // the ring buffer is full
+			continue;
 		}
-		_samplesLeft -= count;
-		len -= count;
-		for (int i = 0; i < count; ++i) {
-			mixChannel(*buf, &_channels[0]);
-			mixChannel(*buf, &_channels[3]);
-			++buf;
-			mixChannel(*buf, &_channels[1]);
-			mixChannel(*buf, &_channels[2]);
-			++buf;
+		const uint32_t pos = frames % p->_prerenderSize;
+		int count = p->_prerenderSize - pos;
+		if (count > PRERENDER_CHUNK) {
+			count = PRERENDER_CHUNK;
+		}
+		if (ahead < 0) {
+			// already played by the audio callback, only advance the sequencer
+			if (count > -ahead) {
+				count = -ahead;
+			}
+			state->mixSamples(buf, count, false);
+		} else {
+			if (count > (int)p->_prerenderSize - ahead) {
+				count = p->_prerenderSize - ahead;
+			}
+			memset(buf, 0, sizeof(buf));
+			state->mixSamples(buf, count);
+			int16_t *dst = p->_prerenderBuf + pos * 2;
+			for (int i = 0; i < count * 2; ++i) {
+				const int sample = buf[i];
+				dst[i] = sample < -32768 ? -32768 : ((sample > 32767 ? 32767 : sample));
+			}
 		}
+		frames += count;
+		SDL_MemoryBarrierRelease();
+		SDL_AtomicSet(&p->_prerenderedFrames, frames);
+		SDL_Delay(1); // leave some time to the game thread
 	}
+	debug(DBG_SND, "SfxPlayer prerendered %d frames in %d ms", frames, SDL_GetTicks() - startTicks);
+	return 0;
 }
 
-void SfxPlayer::readSamples(int16_t *buf, int len) {
-	if (_delay != 0) {
-		mixSamples(buf, len / 2);
+// called by the game thread when the mixer plays the module, the audio callback only mixes the channels
+void SfxPlayer::startLockstep(int rate) {
+	if (!_lockstep) {
+		return;
+	}
+	if (!_lockstepState) {
+		_lockstepState = new SfxPlayer(_res);
+		_lockstepState->_lockstepParent = this;
+	}
+	_lockstepState->_delay = _delay;
+	_lockstepState->_sfxMod = _sfxMod;
+	_lockstepState->play(rate);
+	_lockstepState->_channelsChanged = _lockstepState->_channelsVolume = 0;
+}
+
+void SfxPlayer::stopLockstep() {
+	if (_lockstepState) {
+		_lockstepState->stop();
+	}
+}
+
+// called on the copy by the game thread, see Mixer::advanceSfxMusic()
+void SfxPlayer::advanceLockstep(int ms) {
+	_channelsChanged = _channelsVolume = 0;
+	if (_playing && _delay != 0 && _rate != 0) {
+		int len = ms * _rate / 1000;
+		while (len != 0) {
+			if (_samplesLeft == 0) {
+				handleEvents();
+				_samplesLeft = getSamplesPerTick();
+			}
+			int count = _samplesLeft;
+			if (count > len) {
+				count = len;
+			}
+			_samplesLeft -= count;
+			_samplesPlayed += count;
+			len -= count;
+		}
+	}
+}
+
+void SfxPlayer::pushSyncEvent(uint16_t value) {
+	if (_isRenderCopy) {
+		return;
+	}
+	// the lockstep copy pushes to the player read by the script, the game thread is then the only producer
+	SfxPlayer *p = _lockstepParent ? _lockstepParent : this;
+	const uint32_t readPos = SDL_AtomicGet(&p->_syncEventsRead);
+	const uint32_t writePos = SDL_AtomicGet(&p->_syncEventsWrite);
+	if (writePos - readPos >= NUM_SYNC_EVENTS) {
+		++p->_syncEventsDropped;
+		warning("SfxPlayer sync events queue full, dropped %d", p->_syncEventsDropped);
+		return;
+	}
+	SfxSyncEvent *ev = &p->_syncEvents[writePos & (NUM_SYNC_EVENTS - 1)];
+	ev->value = value;
+	ev->samplePos = _samplesPlayed;
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicSet(&p->_syncEventsWrite, writePos + 1);
+}
+
+bool SfxPlayer::popSyncEvent(SfxSyncEvent *ev) {
+	const uint32_t readPos = SDL_AtomicGet(&_syncEventsRead);
+	const uint32_t writePos = SDL_AtomicGet(&_syncEventsWrite);
+	SDL_MemoryBarrierAcquire();
+	if (readPos == writePos) {
+		return false;
 	}
+	*ev = _syncEvents[readPos & (NUM_SYNC_EVENTS - 1)];
+	SDL_AtomicSet(&_syncEventsRead, readPos + 1);
+	return true;
 }
 
 void SfxPlayer::start() {
@@ -200,15 +392,17 @@ void SfxPlayer::handlePattern(uint8_t channel, const uint8_t *data) {
 					}
 				}
 				_channels[channel].volume = m;
+				_channelsVolume |= 1 << channel;
 				pat.sampleVolume = m;
 			}
 		}
 	}
 	if (pat.note_1 == 0xFFFD) {
-		debug(DBG_SND, "SfxPlayer::handlePattern() _syncVar = 0x%X", pat.note_2);
-		*_syncVar = pat.note_2;
+		debug(DBG_SND, "SfxPlayer::handlePattern() sync = 0x%X", pat.note_2);
+		pushSyncEvent(pat.note_2);
 	} else if (pat.note_1 == 0xFFFE) {
 		_channels[channel].sampleLen = 0;
+		_channelsChanged |= 1 << channel;
 	} else if (pat.note_1 != 0 && pat.sampleBuffer != 0) {
 		assert(pat.note_1 >= 0x37 && pat.note_1 < 0x1000);
 		// convert Amiga period value to hz
@@ -222,5 +416,6 @@ void SfxPlayer::handlePattern(uint8_t channel, const uint8_t *data) {
 		ch->volume = pat.sampleVolume;
 		ch->pos.offset = 0;
 		ch->pos.inc = (freq << Frac::BITS) / _rate;
+		_channelsChanged |= 1 << channel;
 	}
 }
@@ -7,7 +7,9 @@
 #ifndef SFXPLAYER_H__
 #define SFXPLAYER_H__
 
+#include <SDL.h>
 #include "intern.h"
+#include "mixerchannel.h"
 
 struct SfxInstrument {
 	uint8_t *data;
@@ -34,45 +36,82 @@ struct SfxPattern {
 	uint16_t sampleVolume;
 };
 
-struct SfxChannel {
-	uint8_t *sampleData;
-	uint16_t sampleLen;
-	uint16_t sampleLoopPos;
-	uint16_t sampleLoopLen;
-	uint16_t volume;
-	Frac pos;
+struct SfxSyncEvent {
+	uint16_t value;
+	uint32_t samplePos;
 };
 
 struct Resource;
 
 struct SfxPlayer {
 	enum {
-		NUM_CHANNELS = 4
+		NUM_CHANNELS = 4,
+		NUM_SYNC_EVENTS = 16, // must be a power of 2
+		PRERENDER_SECONDS = 4,
+		PRERENDER_CHUNK = 1024
 	};
 
+	static bool _lockstep;
+	static bool _prerender;
+
 	Resource *_res;
 
 	uint16_t _delay;
 	uint16_t _resNum;
 	SfxModule _sfxMod;
-	int16_t *_syncVar;
 	bool _playing;
 	int _rate;
 	int _samplesLeft;
 	SfxChannel _channels[NUM_CHANNELS];
 
+	// VAR_MUSIC_SYNC markers, pushed by the audio thread and applied by the script between frames
+	SfxSyncEvent _syncEvents[NUM_SYNC_EVENTS];
+	SDL_atomic_t _syncEventsRead, _syncEventsWrite;
+	uint32_t _samplesPlayed;
+	int _syncEventsDropped;
+
+	// module rendered ahead by a background thread in a ring buffer, the sequencer
+	// keeps running in the audio callback and takes over once the rendered samples run out
+	int16_t *_prerenderBuf;
+	uint32_t _prerenderSize; // frames
+	SDL_atomic_t _prerenderedFrames, _prerenderReadFrames;
+	SDL_atomic_t _prerenderCancel;
+	SDL_Thread *_prerenderThread;
+	SfxPlayer *_prerenderState;
+	bool _usePrerender;
+	int _prerenderGen; // incremented by startPrerender()
+	SDL_atomic_t _prerenderResetGen; // set by resetPrerender() from the audio callback, the render thread waits for it
+	bool _isRenderCopy;
+
+	// with _lockstep, the sequencer runs in a copy advanced by the game thread with
+	// the frames, the mixer sends the channels it changed to the audio callback
+	SfxPlayer *_lockstepState;
+	SfxPlayer *_lockstepParent; // set in the copy, receives its sync events
+	uint8_t _channelsChanged, _channelsVolume; // channels replaced or with a new volume since the last advanceLockstep
+
 	SfxPlayer(Resource *res);
+	~SfxPlayer();
 
 	void setEventsDelay(uint16_t delay);
 	void loadSfxModule(uint16_t resNum, uint16_t delay, uint8_t pos);
 	void prepareInstruments(const uint8_t *p);
 	void play(int rate);
-	void mixSamples(int16_t *buf, int len);
-	void readSamples(int16_t *buf, int len);
+	void mixSamples(int32_t *buf, int len, bool mix = true);
+	void readSamples(int32_t *buf, int len);
 	void start();
 	void stop();
 	void handleEvents();
 	void handlePattern(uint8_t channel, const uint8_t *patternData);
+	int getSamplesPerTick() const;
+	void pushSyncEvent(uint16_t value);
+	bool popSyncEvent(SfxSyncEvent *ev);
+	void startLockstep(int rate);
+	void stopLockstep();
+	void advanceLockstep(int ms);
+	int startPrerender(int rate);
+	void resetPrerender(int gen);
+	void stopPrerender();
+	static int prerenderThread(void *data);
 };
 
 #endif
@@ -0,0 +1,217 @@
+/*
+ * Reference decoder and test encoder for the bytekiller streams of the
+ * Amiga and DOS data files.
+ */
+
+#include <vector>
+#include "bytekiller.h"
+#include "util.h"
+
+// decoder from the baseline unpack.cpp, reading the stream one bit at a time
+
+struct RefUnpackCtx {
+	int size;
+	uint32_t crc;
+	uint32_t bits;
+	uint8_t *dst;
+	const uint8_t *src;
+};
+
+static bool nextBit(RefUnpackCtx *uc) {
+	bool carry = (uc->bits & 1) != 0;
+	uc->bits >>= 1;
+	if (uc->bits == 0) { // getnextlwd
+		uc->bits = READ_BE_UINT32(uc->src); uc->src -= 4;
+		uc->crc ^= uc->bits;
+		carry = (uc->bits & 1) != 0;
+		uc->bits = (1 << 31) | (uc->bits >> 1);
+	}
+	return carry;
+}
+
+static int getBits(RefUnpackCtx *uc, int count) { // rdd1bits
+	int bits = 0;
+	for (int i = 0; i < count; ++i) {
+		bits <<= 1;
+		if (nextBit(uc)) {
+			bits |= 1;
+		}
+	}
+	return bits;
+}
+
+static void copyLiteral(RefUnpackCtx *uc, int bitsCount, int len) { // getd3chr
+	int count = getBits(uc, bitsCount) + len + 1;
+	uc->size -= count;
+	if (uc->size < 0) {
+		count += uc->size;
+		uc->size = 0;
+	}
+	for (int i = 0; i < count; ++i) {
+		*(uc->dst - i) = (uint8_t)getBits(uc, 8);
+	}
+	uc->dst -= count;
+}
+
+static void copyReference(RefUnpackCtx *uc, int bitsCount, int count) { // copyd3bytes
+	uc->size -= count;
+	if (uc->size < 0) {
+		count += uc->size;
+		uc->size = 0;
+	}
+	const int offset = getBits(uc, bitsCount);
+	for (int i = 0; i < count; ++i) {
+		*(uc->dst - i) = *(uc->dst - i + offset);
+	}
+	uc->dst -= count;
+}
+
+bool bytekiller_unpack_ref(uint8_t *dst, int dstSize, const uint8_t *src, int srcSize) {
+	RefUnpackCtx uc;
+	uc.src = src + srcSize - 4;
+	uc.size = READ_BE_UINT32(uc.src); uc.src -= 4;
+	if (uc.size > dstSize) {
+		warning("Unexpected unpack size %d, buffer size %d", uc.size, dstSize);
+		return false;
+	}
+	uc.dst = dst + uc.size - 1;
+	uc.crc = READ_BE_UINT32(uc.src); uc.src -= 4;
+	uc.bits = READ_BE_UINT32(uc.src); uc.src -= 4;
+	uc.crc ^= uc.bits;
+	do {
+		if (!nextBit(&uc)) {
+			if (!nextBit(&uc)) {
+				copyLiteral(&uc, 3, 0);
+			} else {
+				copyReference(&uc, 8, 2);
+			}
+		} else {
+			const int code = getBits(&uc, 2);
+			switch (code) {
+			case 3:
+				copyLiteral(&uc, 8, 8);
+				break;
+			case 2:
+				copyReference(&uc, 12, getBits(&uc, 8) + 1);
+				break;
+			case 1:
+				copyReference(&uc, 10, 4);
+				break;
+			case 0:
+				copyReference(&uc, 9, 3);
+				break;
+			}
+		}
+	} while (uc.size > 0);
+	assert(uc.size == 0);
+	return uc.crc == 0;
+}
+
+// encoder, the output is written from the end like the decoder reads it
+
+struct PackCtx {
+	std::vector<bool> bits; // in the order the decoder reads them
+
+	void putBits(int value, int count) {
+		for (int i = count - 1; i >= 0; --i) {
+			bits.push_back(((value >> i) & 1) != 0);
+		}
+	}
+	void putLiterals(const uint8_t *src, int pos, int count) {
+		while (count != 0) {
+			int len = count;
+			if (len > 264) {
+				len = 264;
+			}
+			if (len > 8) {
+				putBits(7, 3);
+				putBits(len - 9, 8);
+			} else {
+				putBits(0, 2);
+				putBits(len - 1, 3);
+			}
+			for (int i = 0; i < len; ++i) {
+				putBits(src[pos - i], 8);
+			}
+			pos -= len;
+			count -= len;
+		}
+	}
+	void putReference(int offset, int count) {
+		if (count == 2 && offset < 256) {
+			putBits(1, 2);
+			putBits(offset, 8);
+		} else if (count == 3 && offset < 512) {
+			putBits(4, 3);
+			putBits(offset, 9);
+		} else if (count == 4 && offset < 1024) {
+			putBits(5, 3);
+			putBits(offset, 10);
+		} else {
+			putBits(6, 3);
+			putBits(count - 1, 8);
+			putBits(offset, 12);
+		}
+	}
+};
+
+int bytekiller_pack(uint8_t *dst, const uint8_t *src, int srcSize) {
+	PackCtx pc;
+	int literals = 0;
+	int pos = srcSize - 1;
+	while (pos >= 0) {
+		int bestLen = 0, bestOffset = 0;
+		for (int offset = 1; offset < 4096 && pos + offset < srcSize; ++offset) {
+			int len = 0;
+			while (len < 256 && len <= pos && src[pos - len] == src[pos - len + offset]) {
+				++len;
+			}
+			if (len > bestLen) {
+				bestLen = len;
+				bestOffset = offset;
+				if (len == 256) {
+					break;
+				}
+			}
+		}
+		if (bestLen >= 3 || (bestLen == 2 && bestOffset < 256)) {
+			pc.putLiterals(src, pos + literals, literals);
+			literals = 0;
+			pc.putReference(bestOffset, bestLen);
+			pos -= bestLen;
+		} else {
+			++literals;
+			--pos;
+		}
+	}
+	pc.putLiterals(src, pos + literals, literals);
+	if (srcSize == 0) {
+		// the decoder runs at least one command
+		pc.putBits(0, 5);
+	}
+
+	// the first word holds the remaining bits under its highest set bit, then 32 bits per word
+	const int count = pc.bits.size();
+	const int first = count % 32;
+	const int words = 1 + count / 32;
+	uint32_t crc = 0;
+	uint8_t *p = dst + (words - 1) * 4;
+	int bit = 0;
+	for (int w = 0; w < words; ++w) {
+		const int len = (w == 0) ? first : 32;
+		uint32_t word = (w == 0) ? (1U << first) : 0;
+		for (int i = 0; i < len; ++i) {
+			if (pc.bits[bit++]) {
+				word |= 1U << i;
+			}
+		}
+		crc ^= word;
+		p[0] = word >> 24; p[1] = word >> 16; p[2] = word >> 8; p[3] = word;
+		p -= 4;
+	}
+	p = dst + words * 4;
+	p[0] = crc >> 24; p[1] = crc >> 16; p[2] = crc >> 8; p[3] = crc;
+	p += 4;
+	p[0] = srcSize >> 24; p[1] = srcSize >> 16; p[2] = srcSize >> 8; p[3] = srcSize;
+	return (words + 2) * 4;
+}
@@ -0,0 +1,18 @@
+#ifndef BYTEKILLER_H__
+#define BYTEKILLER_H__
+
+#include "intern.h"
+
+// the bit-by-bit decoder unpack.cpp had before, the reference
+extern bool bytekiller_unpack_ref(uint8_t *dst, int dstSize, const uint8_t *src, int srcSize);
+
+// greedy encoder producing the streams the decoders expect, returns the packed size.
+// dst needs bytekiller_packBound(srcSize) bytes
+extern int bytekiller_pack(uint8_t *dst, const uint8_t *src, int srcSize);
+
+static inline int bytekiller_packBound(int srcSize) {
+	// a byte takes at most 13 bits, plus the size, crc and first words
+	return srcSize * 2 + 16;
+}
+
+#endif // BYTEKILLER_H__
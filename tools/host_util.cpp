@@ -0,0 +1,38 @@
+/*
+ * util.cpp shows the errors in the PSP menu, the host programs print them.
+ */
+
+#include <cstdarg>
+#include "util.h"
+
+uint16_t g_debugMask;
+char g_error_message[1024] = "\0";
+bool g_has_error = false;
+
+void debug(uint16_t cm, const char *msg, ...) {
+	if (cm & g_debugMask) {
+		va_list va;
+		va_start(va, msg);
+		vprintf(msg, va);
+		va_end(va);
+		printf("\n");
+	}
+}
+
+void error(const char *msg, ...) {
+	va_list va;
+	va_start(va, msg);
+	vsnprintf(g_error_message, 1024, msg, va);
+	va_end(va);
+	fprintf(stderr, "ERROR: %s!\n", g_error_message);
+	exit(-1);
+}
+
+void warning(const char *msg, ...) {
+	va_list va;
+	va_start(va, msg);
+	fprintf(stderr, "WARNING: ");
+	vfprintf(stderr, msg, va);
+	va_end(va);
+	fprintf(stderr, "!\n");
+}
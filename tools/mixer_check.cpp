@@ -0,0 +1,346 @@
+
+/*
+ * Compares the block mixers of mixerchannel.h with the per-sample mixers
+ * they replaced, on random sounds, loops, rates and block sizes.
+ *
+ * The per-sample mixers saturated after each channel and the block mixers
+ * saturate the sum, the channel volumes are chosen so that no intermediate
+ * sum clips. The output must then be identical.
+ */
+
+#include "mixerchannel.h"
+
+// previous per-sample mixers, the reference
+
+static int16_t mixS16(int sample1, int sample2) {
+	const int sample = sample1 + sample2;
+	return sample < -32768 ? -32768 : ((sample > 32767 ? 32767 : sample));
+}
+
+struct RefMixerChannel {
+	const uint8_t *_data;
+	Frac _pos;
+	uint32_t _len;
+	uint32_t _loopLen, _loopPos;
+	int _volume;
+
+	void initRaw(const uint8_t *data, int freq, int volume, int mixingFreq) {
+		_data = data + 8;
+		_pos.reset(freq, mixingFreq);
+
+		const int len = READ_BE_UINT16(data) * 2;
+		_loopLen = READ_BE_UINT16(data + 2) * 2;
+		_loopPos = _loopLen ? len : 0;
+		_len = len;
+
+		_volume = volume;
+	}
+
+	void initWav(const uint8_t *data, int freq, int volume, int mixingFreq, int len, bool loop) {
+		_data = data;
+		_pos.reset(freq, mixingFreq);
+
+		_len = len;
+		_loopLen = loop ? len : 0;
+		_loopPos = 0;
+		_volume = volume;
+	}
+
+	void mixRaw(int16_t &sample) {
+		if (_data) {
+			uint32_t pos = _pos.getInt();
+			_pos.offset += _pos.inc;
+			if (_loopLen != 0) {
+				if (pos >= _loopPos + _loopLen) {
+					pos = _loopPos;
+					_pos.offset = (_loopPos << Frac::BITS) + _pos.inc;
+				}
+			} else {
+				if (pos >= _len) {
+					_data = 0;
+					return;
+				}
+			}
+			sample = mixS16(sample, MixerChannel::toS16(_data[pos] ^ 0x80) * _volume / 64);
+		}
+	}
+
+	template<int bits, bool stereo>
+	void mixWav(int16_t *samples, int count) {
+		for (int i = 0; i < count; i += 2) {
+			uint32_t pos = _pos.getInt();
+			_pos.offset += _pos.inc;
+			if (pos >= _len) {
+				if (_loopLen != 0) {
+					pos = 0;
+					_pos.offset = _pos.inc;
+				} else {
+					_data = 0;
+					break;
+				}
+			}
+			if (stereo) {
+				pos *= 2;
+			}
+			int valueL;
+			if (bits == 8) { // U8
+				valueL = MixerChannel::toS16(_data[pos]) * _volume / 64;
+			} else { // S16
+				valueL = ((int16_t)READ_LE_UINT16(&_data[pos * sizeof(int16_t)])) * _volume / 64;
+			}
+			*samples = mixS16(*samples, valueL);
+			++samples;
+
+			int valueR;
+			if (!stereo) {
+				valueR = valueL;
+			} else {
+				if (bits == 8) { // U8
+					valueR = MixerChannel::toS16(_data[pos + 1]) * _volume / 64;
+				} else { // S16
+					valueR = ((int16_t)READ_LE_UINT16(&_data[(pos + 1) * sizeof(int16_t)])) * _volume / 64;
+				}
+			}
+			*samples = mixS16(*samples, valueR);
+			++samples;
+		}
+	}
+};
+
+static void refMixWav(RefMixerChannel *ch, bool bits16, bool stereo, int16_t *samples, int count) {
+	if (bits16) {
+		if (stereo) {
+			ch->mixWav<16, true>(samples, count);
+		} else {
+			ch->mixWav<16, false>(samples, count);
+		}
+	} else {
+		if (stereo) {
+			ch->mixWav<8, true>(samples, count);
+		} else {
+			ch->mixWav<8, false>(samples, count);
+		}
+	}
+}
+
+static void refMixSfxChannel(int16_t &s, SfxChannel *ch) {
+	if (ch->sampleLen == 0) {
+		return;
+	}
+	int pos1 = ch->pos.offset >> Frac::BITS;
+	ch->pos.offset += ch->pos.inc;
+	int pos2 = pos1 + 1;
+	if (ch->sampleLoopLen != 0) {
+		if (pos1 >= ch->sampleLoopPos + ch->sampleLoopLen - 1) {
+			pos2 = ch->sampleLoopPos;
+			ch->pos.offset = pos2 << Frac::BITS;
+		}
+	} else {
+		if (pos1 >= ch->sampleLen - 1) {
+			ch->sampleLen = 0;
+			return;
+		}
+	}
+	int sample = ch->pos.interpolate((int8_t)ch->sampleData[pos1], (int8_t)ch->sampleData[pos2]);
+	sample = s + SfxChannel::toS16(sample * ch->volume / 64);
+	s = (sample < -32768 ? -32768 : (sample > 32767 ? 32767 : sample));
+}
+
+static uint32_t _rndState = 1;
+
+static uint32_t rnd(uint32_t max) { // [0, max)
+	_rndState ^= _rndState << 13;
+	_rndState ^= _rndState >> 17;
+	_rndState ^= _rndState << 5;
+	return max ? _rndState % max : 0;
+}
+
+static const int kMixRates[] = { 11025, 22050, 44100, 48000 };
+
+enum {
+	kMaxFrames = 8192,
+	kChannels = 4,
+	kMaxSoundSize = 4096,
+};
+
+static int16_t _refBuf[kMaxFrames * 2];
+static int32_t _mixBuf[kMaxFrames * 2];
+static int16_t _outBuf[kMaxFrames * 2];
+static uint8_t _sounds[kChannels][8 + kMaxSoundSize * 4 + 4];
+
+static int _failures;
+
+static bool compare(const char *name, int testNum, int count) {
+	saturateS16(_mixBuf, _outBuf, count);
+	for (int i = 0; i < count; ++i) {
+		if (_outBuf[i] != _refBuf[i]) {
+			fprintf(stderr, "%s test %d: sample %d is %d, expected %d\n", name, testNum, i, _outBuf[i], _refBuf[i]);
+			++_failures;
+			return false;
+		}
+	}
+	return true;
+}
+
+// the callback buffer is split in blocks of random sizes
+static int nextBlock(int left) {
+	const int n = 1 + rnd(left < 1024 ? left : 1024);
+	return n;
+}
+
+static void checkRaw(int testNum) {
+	const int mixRate = kMixRates[rnd(4)];
+	const int count = 1 + rnd(kChannels);
+	const int maxVolume = (count == 1) ? 64 : 64 / kChannels;
+	MixerChannel channels[kChannels];
+	RefMixerChannel refChannels[kChannels];
+	for (int i = 0; i < count; ++i) {
+		const int len = rnd(kMaxSoundSize / 2);
+		const int loopLen = rnd(4) == 0 ? 0 : rnd(kMaxSoundSize / 2);
+		uint8_t *p = _sounds[i];
+		p[0] = len >> 8; p[1] = len & 255;
+		p[2] = loopLen >> 8; p[3] = loopLen & 255;
+		for (int j = 0; j < (len + loopLen) * 2; ++j) {
+			p[8 + j] = rnd(256);
+		}
+		const int freq = 1000 + rnd(mixRate * 2);
+		const int volume = rnd(maxVolume + 1);
+		channels[i].initRaw(p, freq, volume, mixRate);
+		refChannels[i].initRaw(p, freq, volume, mixRate);
+	}
+	const int frames = 1 + rnd(kMaxFrames);
+	memset(_refBuf, 0, sizeof(_refBuf));
+	for (int i = 0; i < frames; ++i) {
+		for (int j = 0; j < count; ++j) {
+			refChannels[j].mixRaw(_refBuf[i * 2]);
+		}
+		_refBuf[i * 2 + 1] = _refBuf[i * 2];
+	}
+	memset(_mixBuf, 0, sizeof(_mixBuf));
+	for (int pos = 0; pos < frames; ) {
+		const int n = nextBlock(frames - pos);
+		for (int j = 0; j < count; ++j) {
+			channels[j].mixRaw(_mixBuf + pos * 2, n, 2);
+		}
+		for (int i = pos; i < pos + n; ++i) {
+			_mixBuf[i * 2 + 1] = _mixBuf[i * 2];
+		}
+		pos += n;
+	}
+	compare("raw", testNum, frames * 2);
+}
+
+static void checkWav(int testNum) {
+	const int mixRate = kMixRates[rnd(4)];
+	const int count = 1 + rnd(kChannels);
+	const int maxVolume = (count == 1) ? 64 : 64 / kChannels;
+	MixerChannel channels[kChannels];
+	RefMixerChannel refChannels[kChannels];
+	bool bits16[kChannels], stereo[kChannels];
+	for (int i = 0; i < count; ++i) {
+		bits16[i] = rnd(2) != 0;
+		stereo[i] = rnd(2) != 0;
+		const bool loop = rnd(2) != 0;
+		const int len = rnd(kMaxSoundSize);
+		const int size = len * (bits16[i] ? 2 : 1) * (stereo[i] ? 2 : 1);
+		uint8_t *p = _sounds[i];
+		for (int j = 0; j < size; ++j) {
+			p[j] = rnd(256);
+		}
+		const int freq = 1000 + rnd(mixRate * 2);
+		const int volume = rnd(maxVolume + 1);
+		channels[i].initWav(p, freq, volume, mixRate, len, bits16[i], stereo[i], loop);
+		refChannels[i].initWav(p, freq, volume, mixRate, len, loop);
+	}
+	const int frames = 1 + rnd(kMaxFrames);
+	memset(_refBuf, 0, sizeof(_refBuf));
+	memset(_mixBuf, 0, sizeof(_mixBuf));
+	for (int pos = 0; pos < frames; ) {
+		const int n = nextBlock(frames - pos);
+		for (int j = 0; j < count; ++j) {
+			if (refChannels[j]._data) {
+				refMixWav(&refChannels[j], bits16[j], stereo[j], _refBuf + pos * 2, n * 2);
+			}
+			if (channels[j]._data) {
+				(channels[j].*channels[j]._mixWav)(_mixBuf + pos * 2, n * 2);
+			}
+		}
+		pos += n;
+	}
+	compare("wav", testNum, frames * 2);
+}
+
+static void checkSfx(int testNum) {
+	const int mixRate = kMixRates[rnd(4)];
+	const bool single = rnd(2) != 0;
+	const int maxVolume = single ? 64 : 32; // two channels per side
+	SfxChannel channels[kChannels], refChannels[kChannels], posChannels[kChannels];
+	memset(channels, 0, sizeof(channels));
+	for (int i = 0; i < kChannels; ++i) {
+		if (single && i != 0) {
+			continue;
+		}
+		SfxChannel *ch = &channels[i];
+		ch->sampleData = _sounds[i];
+		ch->sampleLen = 1 + rnd(kMaxSoundSize);
+		if (rnd(2)) {
+			ch->sampleLoopPos = rnd(ch->sampleLen);
+			ch->sampleLoopLen = 1 + rnd(ch->sampleLen - ch->sampleLoopPos);
+		}
+		for (int j = 0; j < ch->sampleLen + 1; ++j) {
+			ch->sampleData[j] = rnd(256);
+		}
+		ch->volume = rnd(maxVolume + 1);
+		ch->pos.reset(1000 + rnd(30000), mixRate);
+	}
+	memcpy(refChannels, channels, sizeof(channels));
+	memcpy(posChannels, channels, sizeof(channels));
+	const int frames = 1 + rnd(kMaxFrames);
+	memset(_refBuf, 0, sizeof(_refBuf));
+	for (int i = 0; i < frames; ++i) {
+		refMixSfxChannel(_refBuf[i * 2], &refChannels[0]);
+		refMixSfxChannel(_refBuf[i * 2], &refChannels[3]);
+		refMixSfxChannel(_refBuf[i * 2 + 1], &refChannels[1]);
+		refMixSfxChannel(_refBuf[i * 2 + 1], &refChannels[2]);
+	}
+	memset(_mixBuf, 0, sizeof(_mixBuf));
+	for (int pos = 0; pos < frames; ) {
+		const int n = nextBlock(frames - pos);
+		int32_t *buf = _mixBuf + pos * 2;
+		channels[0].mixSamples<true>(buf, n);
+		channels[3].mixSamples<true>(buf, n);
+		channels[1].mixSamples<true>(buf + 1, n);
+		channels[2].mixSamples<true>(buf + 1, n);
+		for (int i = 0; i < kChannels; ++i) {
+			posChannels[i].mixSamples<false>(buf, n);
+			if (posChannels[i].sampleLen != channels[i].sampleLen || (channels[i].sampleLen != 0 && posChannels[i].pos.offset != channels[i].pos.offset)) {
+				fprintf(stderr, "sfx test %d: channel %d position differs without mixing\n", testNum, i);
+				++_failures;
+				return;
+			}
+		}
+		pos += n;
+	}
+	compare("sfx", testNum, frames * 2);
+}
+
+int main(int argc, char *argv[]) {
+	int count = 2000;
+	if (argc > 1) {
+		count = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		_rndState = strtoul(argv[2], 0, 0) | 1;
+	}
+	for (int i = 0; i < count && _failures < 10; ++i) {
+		checkRaw(i);
+		checkWav(i);
+		checkSfx(i);
+	}
+	if (_failures != 0) {
+		fprintf(stderr, "mixer_check: %d failures\n", _failures);
+		return 1;
+	}
+	printf("mixer_check: %d tests of each mixer passed\n", count);
+	return 0;
+}
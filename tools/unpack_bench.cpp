@@ -0,0 +1,67 @@
+/*
+ * Times bytekiller_unpack() and the bit-by-bit decoder it replaced on the
+ * same packed stream, built from a file given on the command line or from
+ * a generated buffer.
+ */
+
+#include <chrono>
+#include <vector>
+#include "unpack.h"
+#include "bytekiller.h"
+
+static const int kSize = 1 << 15;
+
+typedef bool (*UnpackProc)(uint8_t *dst, int dstSize, const uint8_t *src, int srcSize);
+
+static double bench(UnpackProc proc, std::vector<uint8_t> &out, const std::vector<uint8_t> &packed, int count) {
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < count; ++i) {
+		if (!proc(&out[0], out.size(), &packed[0], packed.size())) {
+			fprintf(stderr, "unpack_bench: crc check failed\n");
+			exit(1);
+		}
+	}
+	const std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+	return t.count();
+}
+
+int main(int argc, char *argv[]) {
+	std::vector<uint8_t> buf;
+	if (argc > 1) {
+		FILE *fp = fopen(argv[1], "rb");
+		if (!fp) {
+			fprintf(stderr, "unpack_bench: unable to open '%s'\n", argv[1]);
+			return 1;
+		}
+		buf.resize(kSize);
+		buf.resize(fread(&buf[0], 1, kSize, fp));
+		fclose(fp);
+	} else {
+		// half random bytes, half copies of the previous ones
+		uint32_t rnd = 1;
+		buf.resize(kSize);
+		for (int i = 0; i < kSize; ++i) {
+			rnd = rnd * 1103515245 + 12345;
+			buf[i] = ((i & 64) && i >= 1000) ? buf[i - 1000] : (rnd >> 16);
+		}
+	}
+	if (buf.empty()) {
+		fprintf(stderr, "unpack_bench: empty input\n");
+		return 1;
+	}
+	std::vector<uint8_t> packed(bytekiller_packBound(buf.size()));
+	packed.resize(bytekiller_pack(&packed[0], &buf[0], buf.size()));
+	const int count = argc > 2 ? atoi(argv[2]) : 200;
+	std::vector<uint8_t> out(buf.size());
+	const double ref = bench(bytekiller_unpack_ref, out, packed, count);
+	const double cur = bench(bytekiller_unpack, out, packed, count);
+	if (memcmp(&out[0], &buf[0], buf.size()) != 0) {
+		fprintf(stderr, "unpack_bench: unpacked data differs\n");
+		return 1;
+	}
+	const double mb = (double)buf.size() * count / (1024 * 1024);
+	printf("%d bytes packed to %d, %d times\n", (int)buf.size(), (int)packed.size(), count);
+	printf("reference: %.1f MB/s\n", mb / ref);
+	printf("bytekiller_unpack: %.1f MB/s (x%.2f)\n", mb / cur, ref / cur);
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * Compares bytekiller_unpack() with the bit-by-bit decoder it replaced.
+ *
+ * Any input is decoded by both, the stream being placed after enough zeroes
+ * for the decoders to never read before the buffer. The outputs and the crc
+ * checks must be identical. The input is also packed and both decoders must
+ * then return it unchanged.
+ *
+ * Built with -DUNPACK_FUZZER, this is a libFuzzer target, otherwise main()
+ * feeds it random and structured buffers.
+ */
+
+#include <vector>
+#include "unpack.h"
+#include "bytekiller.h"
+
+static const int kMaxUnpackSize = 1 << 16;
+static const int kMaxPackSize = 1 << 13; // the encoder searches the 4096 previous bytes for each byte
+
+static int _failures;
+
+static void compare(const char *name, const uint8_t *out, const uint8_t *ref, int size) {
+	for (int i = 0; i < size; ++i) {
+		if (out[i] != ref[i]) {
+			fprintf(stderr, "%s: byte %d is 0x%02X, expected 0x%02X\n", name, i, out[i], ref[i]);
+			++_failures;
+			return;
+		}
+	}
+}
+
+static void checkStream(const uint8_t *data, int size) {
+	if (size < 12) {
+		return;
+	}
+	const int unpackedSize = READ_BE_UINT32(data + size - 4) % (kMaxUnpackSize + 1);
+	// a command writes at least one byte and reads at most 23 bits
+	const int pad = unpackedSize * 3 + 64;
+	std::vector<uint8_t> src(pad + size);
+	memcpy(&src[pad], data, size - 4);
+	uint8_t *p = &src[pad + size - 4];
+	p[0] = unpackedSize >> 24; p[1] = unpackedSize >> 16; p[2] = unpackedSize >> 8; p[3] = unpackedSize;
+	// a reference can read 4095 bytes after the end
+	std::vector<uint8_t> out(unpackedSize + 4096), ref(unpackedSize + 4096);
+	const bool ret = bytekiller_unpack(&out[0], unpackedSize, &src[0], src.size());
+	const bool refRet = bytekiller_unpack_ref(&ref[0], unpackedSize, &src[0], src.size());
+	if (ret != refRet) {
+		fprintf(stderr, "stream: crc check returned %d, expected %d\n", ret, refRet);
+		++_failures;
+	}
+	compare("stream", &out[0], &ref[0], unpackedSize);
+}
+
+static void checkRoundTrip(const uint8_t *data, int size) {
+	if (size > kMaxPackSize) {
+		size = kMaxPackSize;
+	}
+	std::vector<uint8_t> packed(bytekiller_packBound(size));
+	const int packedSize = bytekiller_pack(&packed[0], data, size);
+	std::vector<uint8_t> out(size + 1), ref(size + 1);
+	if (!bytekiller_unpack(&out[0], size, &packed[0], packedSize)) {
+		fprintf(stderr, "round trip: crc check failed, %d bytes\n", size);
+		++_failures;
+	}
+	compare("round trip", &out[0], data, size);
+	if (!bytekiller_unpack_ref(&ref[0], size, &packed[0], packedSize)) {
+		fprintf(stderr, "round trip: reference crc check failed, %d bytes\n", size);
+		++_failures;
+	}
+	compare("round trip reference", &ref[0], data, size);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	checkStream(data, size);
+	checkRoundTrip(data, size);
+	return 0;
+}
+
+#ifndef UNPACK_FUZZER
+
+static uint32_t _rndState = 1;
+
+static uint32_t rnd(uint32_t max) { // [0, max)
+	_rndState ^= _rndState << 13;
+	_rndState ^= _rndState >> 17;
+	_rndState ^= _rndState << 5;
+	return max ? _rndState % max : 0;
+}
+
+// runs, repeated strings and random bytes, like the resources
+static void fillStructured(std::vector<uint8_t> &buf) {
+	int pos = 0;
+	while (pos < (int)buf.size()) {
+		int len = 1 + rnd(300);
+		if (len > (int)buf.size() - pos) {
+			len = buf.size() - pos;
+		}
+		switch (rnd(3)) {
+		case 0:
+			memset(&buf[pos], rnd(256), len);
+			break;
+		case 1:
+			if (pos != 0) {
+				const int offset = 1 + rnd(pos < 5000 ? pos : 5000);
+				for (int i = 0; i < len; ++i) {
+					buf[pos + i] = buf[pos + i - offset];
+				}
+				break;
+			}
+			// fall through
+		default:
+			for (int i = 0; i < len; ++i) {
+				buf[pos + i] = rnd(4 + rnd(252));
+			}
+			break;
+		}
+		pos += len;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int count = 500;
+	if (argc > 1) {
+		count = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		_rndState = strtoul(argv[2], 0, 0) | 1;
+	}
+	std::vector<uint8_t> buf;
+	for (int i = 0; i < count && _failures < 10; ++i) {
+		buf.resize(12 + rnd(4096));
+		for (size_t j = 0; j < buf.size(); ++j) {
+			buf[j] = rnd(256);
+		}
+		checkStream(&buf[0], buf.size());
+		buf.resize(rnd(kMaxPackSize));
+		fillStructured(buf);
+		checkRoundTrip(buf.empty() ? 0 : &buf[0], buf.size());
+	}
+	if (_failures != 0) {
+		fprintf(stderr, "unpack_check: %d failures\n", _failures);
+		return 1;
+	}
+	printf("unpack_check: %d random and %d packed streams passed\n", count, count);
+	return 0;
+}
+
+#endif
@@ -10,32 +10,53 @@
 struct UnpackCtx {
 	int size;
 	uint32_t crc;
-	uint32_t bits;
+	uint64_t bits; // next bits of the stream from bit 0
+	int len; // number of bits in 'bits'
 	uint8_t *dst;
 	const uint8_t *src;
 };
 
-static bool nextBit(UnpackCtx *uc) {
-	bool carry = (uc->bits & 1) != 0;
-	uc->bits >>= 1;
-	if (uc->bits == 0) { // getnextlwd
-		uc->bits = READ_BE_UINT32(uc->src); uc->src -= 4;
-		uc->crc ^= uc->bits;
-		carry = (uc->bits & 1) != 0;
-		uc->bits = (1 << 31) | (uc->bits >> 1);
+static void nextWord(UnpackCtx *uc) { // getnextlwd
+	const uint32_t word = READ_BE_UINT32(uc->src); uc->src -= 4;
+	uc->crc ^= word;
+	uc->bits |= ((uint64_t)word) << uc->len;
+	uc->len += 32;
+}
+
+// the stream is read from bit 0 of each word, fields are stored with their most significant bit first
+static uint32_t reverseBits(uint32_t x, int count) {
+	x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+	x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+	x = ((x >> 4) & 0x0F0F0F0F) | ((x & 0x0F0F0F0F) << 4);
+	x = ((x >> 8) & 0x00FF00FF) | ((x & 0x00FF00FF) << 8);
+	x = (x >> 16) | (x << 16);
+	return x >> (32 - count);
+}
+
+static uint8_t reverseBits8(uint32_t x) {
+	x = ((x >> 1) & 0x55) | ((x & 0x55) << 1);
+	x = ((x >> 2) & 0x33) | ((x & 0x33) << 2);
+	return (x >> 4) | (x << 4);
+}
+
+static inline bool nextBit(UnpackCtx *uc) {
+	if (uc->len == 0) {
+		nextWord(uc);
 	}
+	const bool carry = (uc->bits & 1) != 0;
+	uc->bits >>= 1;
+	--uc->len;
 	return carry;
 }
 
-static int getBits(UnpackCtx *uc, int count) { // rdd1bits
-	int bits = 0;
-	for (int i = 0; i < count; ++i) {
-		bits <<= 1;
-		if (nextBit(uc)) {
-			bits |= 1;
-		}
+static inline int getBits(UnpackCtx *uc, int count) { // rdd1bits
+	if (uc->len < count) {
+		nextWord(uc);
 	}
-	return bits;
+	const uint32_t bits = (uint32_t)uc->bits & ((1 << count) - 1);
+	uc->bits >>= count;
+	uc->len -= count;
+	return reverseBits(bits, count);
 }
 
 static void copyLiteral(UnpackCtx *uc, int bitsCount, int len) { // getd3chr
@@ -46,7 +67,12 @@ static void copyLiteral(UnpackCtx *uc, int bitsCount, int len) { // getd3chr
 		uc->size = 0;
 	}
 	for (int i = 0; i < count; ++i) {
-		*(uc->dst - i) = (uint8_t)getBits(uc, 8);
+		if (uc->len < 8) {
+			nextWord(uc);
+		}
+		*(uc->dst - i) = reverseBits8((uint32_t)uc->bits & 255);
+		uc->bits >>= 8;
+		uc->len -= 8;
 	}
 	uc->dst -= count;
 }
@@ -58,8 +84,16 @@ static void copyReference(UnpackCtx *uc, int bitsCount, int count) { // copyd3by
 		uc->size = 0;
 	}
 	const int offset = getBits(uc, bitsCount);
-	for (int i = 0; i < count; ++i) {
-		*(uc->dst - i) = *(uc->dst - i + offset);
+	uint8_t *dst = uc->dst - count + 1;
+	if (offset >= count) {
+		memcpy(dst, dst + offset, count);
+	} else if (offset == 1) {
+		memset(dst, uc->dst[1], count);
+	} else if (offset != 0) {
+		// the source overlaps the bytes being written, copied backwards
+		for (int i = 0; i < count; ++i) {
+			*(uc->dst - i) = *(uc->dst - i + offset);
+		}
 	}
 	uc->dst -= count;
 }
@@ -74,8 +108,14 @@ bool bytekiller_unpack(uint8_t *dst, int dstSize, const uint8_t *src, int srcSiz
 	}
 	uc.dst = dst + uc.size - 1;
 	uc.crc = READ_BE_UINT32(uc.src); uc.src -= 4;
-	uc.bits = READ_BE_UINT32(uc.src); uc.src -= 4;
-	uc.crc ^= uc.bits;
+	const uint32_t bits = READ_BE_UINT32(uc.src); uc.src -= 4;
+	uc.crc ^= bits;
+	// the highest bit set in the first word marks the end of the stream
+	uc.len = 0;
+	while (uc.len < 31 && (bits >> (uc.len + 1)) != 0) {
+		++uc.len;
+	}
+	uc.bits = bits & ((1U << uc.len) - 1);
 	do {
 		if (!nextBit(&uc)) {
 			if (!nextBit(&uc)) {
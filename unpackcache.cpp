@@ -0,0 +1,228 @@
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include "unpackcache.h"
+#include "resource.h"
+#include "util.h"
+
+static const uint32_t kCacheVersion = 2;
+
+static uint32_t alignOffset(uint32_t offset) {
+	return (offset + UnpackCache::kAlignment - 1) & ~(UnpackCache::kAlignment - 1);
+}
+
+static uint32_t checksumData(const uint8_t *p, uint32_t size) {
+	uint32_t hash = 2166136261U; // FNV-1a
+	for (uint32_t i = 0; i < size; ++i) {
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+UnpackCache::UnpackCache()
+	: _isOpen(false), _fileSize(0), _entriesCount(0), _hits(0), _misses(0) {
+	_path[0] = 0;
+}
+
+UnpackCache::~UnpackCache() {
+	debug(DBG_RESOURCE, "UnpackCache hits %d misses %d entries %d", _hits, _misses, _entriesCount);
+}
+
+bool UnpackCache::init(const char *dataDir, const uint32_t *sourceSizes) {
+	char dirPath[MAXPATHLEN];
+	if (snprintf(dirPath, sizeof(dirPath), "%s/cache", dataDir) >= (int)sizeof(dirPath)) {
+		warning("Unpack cache path too long for '%s'", dataDir);
+		return false;
+	}
+	struct stat s;
+	if (stat(dirPath, &s) != 0 && mkdir(dirPath, 0777) != 0) {
+		warning("Unable to create unpack cache directory '%s'", dirPath);
+		return false;
+	}
+	if (snprintf(_path, sizeof(_path), "%s/banks.bin", dirPath) >= (int)sizeof(_path)) {
+		warning("Unpack cache path too long for '%s'", dataDir);
+		return false;
+	}
+	memcpy(_header, "AWUC", 4);
+	WRITE_LE_UINT32(_header + 4, kCacheVersion);
+	for (int i = 0; i < kSourcesCount; ++i) {
+		WRITE_LE_UINT32(_header + 8 + i * 4, sourceSizes[i]);
+	}
+	if (!readEntries()) {
+		return create();
+	}
+	return true;
+}
+
+bool UnpackCache::create() {
+	_f.close();
+	_isOpen = false;
+	_entriesCount = 0;
+	File f;
+	if (!f.openForWriting(_path)) {
+		warning("Unable to create '%s'", _path);
+		return false;
+	}
+	uint8_t padding[kAlignment];
+	memset(padding, 0, sizeof(padding));
+	f.write(_header, kHeaderSize);
+	f.write(padding, alignOffset(kHeaderSize) - kHeaderSize);
+	if (f.ioErr()) {
+		warning("Failed to write '%s'", _path);
+		f.close();
+		unlink(_path);
+		return false;
+	}
+	_fileSize = alignOffset(kHeaderSize);
+	return true;
+}
+
+bool UnpackCache::readEntries() {
+	_entriesCount = 0;
+	File f;
+	if (!f.open(_path)) {
+		return false;
+	}
+	_fileSize = f.size();
+	uint8_t buf[kHeaderSize];
+	if (f.read(buf, kHeaderSize) != kHeaderSize || memcmp(buf, _header, kHeaderSize) != 0) {
+		debug(DBG_RESOURCE, "UnpackCache '%s' does not match the data files", _path);
+		return false;
+	}
+	uint32_t offset = alignOffset(kHeaderSize);
+	while (offset < _fileSize) {
+		if (_entriesCount == kMaxEntries) {
+			return false;
+		}
+		f.seek(offset);
+		uint8_t hdr[kRecordHeaderSize];
+		if (f.read(hdr, kRecordHeaderSize) != kRecordHeaderSize) {
+			return false;
+		}
+		UnpackCacheEntry *e = &_entries[_entriesCount];
+		e->bankNum = hdr[0];
+		e->kind = hdr[1];
+		e->bankPos = READ_LE_UINT32(hdr + 4);
+		e->packedSize = READ_LE_UINT32(hdr + 8);
+		e->unpackedSize = READ_LE_UINT32(hdr + 12);
+		e->checksum = READ_LE_UINT32(hdr + 16);
+		e->dataOffset = alignOffset(offset + kRecordHeaderSize);
+		if (e->dataOffset > _fileSize || e->unpackedSize > _fileSize - e->dataOffset) {
+			// interrupted while appending
+			return false;
+		}
+		offset = alignOffset(e->dataOffset + e->unpackedSize);
+		++_entriesCount;
+	}
+	debug(DBG_RESOURCE, "UnpackCache %d entries", _entriesCount);
+	return true;
+}
+
+const UnpackCacheEntry *UnpackCache::find(const MemEntry *me) const {
+	for (int i = 0; i < _entriesCount; ++i) {
+		const UnpackCacheEntry *e = &_entries[i];
+		if (e->kind == kKindBank && e->bankNum == me->bankNum && e->bankPos == me->bankPos && e->packedSize == me->packedSize && e->unpackedSize == me->unpackedSize) {
+			return e;
+		}
+	}
+	return 0;
+}
+
+const UnpackCacheEntry *UnpackCache::findData(int num, uint32_t sourceSize) const {
+	for (int i = 0; i < _entriesCount; ++i) {
+		const UnpackCacheEntry *e = &_entries[i];
+		if (e->kind == kKindData && e->bankPos == uint32_t(num) && e->packedSize == sourceSize) {
+			return e;
+		}
+	}
+	return 0;
+}
+
+bool UnpackCache::read(const UnpackCacheEntry *e, uint8_t *dst) {
+	if (!_isOpen) {
+		_isOpen = _f.open(_path);
+		if (!_isOpen) {
+			return false;
+		}
+	}
+	_f.seek(e->dataOffset);
+	if (_f.read(dst, e->unpackedSize) != (int)e->unpackedSize || checksumData(dst, e->unpackedSize) != e->checksum) {
+		warning("UnpackCache entry at 0x%x is invalid, rebuilding '%s'", e->dataOffset, _path);
+		++_misses;
+		// the next add() appends the entry again instead of matching the bad record
+		create();
+		return false;
+	}
+	++_hits;
+	return true;
+}
+
+void UnpackCache::add(const MemEntry *me, const uint8_t *data) {
+	if (find(me)) {
+		return;
+	}
+	UnpackCacheEntry key;
+	key.kind = kKindBank;
+	key.bankNum = me->bankNum;
+	key.bankPos = me->bankPos;
+	key.packedSize = me->packedSize;
+	key.unpackedSize = me->unpackedSize;
+	append(&key, data);
+}
+
+void UnpackCache::addData(int num, uint32_t sourceSize, const uint8_t *data, uint32_t size) {
+	if (findData(num, sourceSize)) {
+		return;
+	}
+	UnpackCacheEntry key;
+	key.kind = kKindData;
+	key.bankNum = 0;
+	key.bankPos = num;
+	key.packedSize = sourceSize;
+	key.unpackedSize = size;
+	append(&key, data);
+}
+
+void UnpackCache::append(const UnpackCacheEntry *key, const uint8_t *data) {
+	if (_entriesCount == kMaxEntries) {
+		return;
+	}
+	++_misses;
+	uint8_t hdr[kRecordHeaderSize];
+	memset(hdr, 0, sizeof(hdr));
+	hdr[0] = key->bankNum;
+	hdr[1] = key->kind;
+	WRITE_LE_UINT32(hdr + 4, key->bankPos);
+	WRITE_LE_UINT32(hdr + 8, key->packedSize);
+	WRITE_LE_UINT32(hdr + 12, key->unpackedSize);
+	const uint32_t checksum = checksumData(data, key->unpackedSize);
+	WRITE_LE_UINT32(hdr + 16, checksum);
+	const uint32_t dataOffset = alignOffset(_fileSize + kRecordHeaderSize);
+	const uint32_t endOffset = alignOffset(dataOffset + key->unpackedSize);
+	uint8_t padding[kAlignment];
+	memset(padding, 0, sizeof(padding));
+	File f;
+	if (!f.openForAppending(_path)) {
+		return;
+	}
+	f.write(hdr, kRecordHeaderSize);
+	f.write(padding, dataOffset - (_fileSize + kRecordHeaderSize));
+	f.write((void *)data, key->unpackedSize);
+	f.write(padding, endOffset - (dataOffset + key->unpackedSize));
+	if (f.ioErr()) {
+		warning("Failed to write '%s'", _path);
+		f.close();
+		// a partial record would hide the ones appended after it
+		create();
+		return;
+	}
+	UnpackCacheEntry *e = &_entries[_entriesCount++];
+	*e = *key;
+	e->checksum = checksum;
+	e->dataOffset = dataOffset;
+	_fileSize = endOffset;
+	// reopened by the next read, the read-ahead window may end at the previous size
+	_f.close();
+	_isOpen = false;
+}
@@ -0,0 +1,65 @@
+
+#ifndef UNPACK_CACHE_H__
+#define UNPACK_CACHE_H__
+
+#include "intern.h"
+#include "file.h"
+
+struct MemEntry;
+
+struct UnpackCacheEntry {
+	uint8_t kind;
+	uint8_t bankNum;
+	uint32_t bankPos;
+	uint32_t packedSize;
+	uint32_t unpackedSize;
+	uint32_t checksum;
+	uint32_t dataOffset;
+};
+
+// Decoded entries appended to a single file in <data>/cache the first time
+// they are loaded: the bytekiller packed banks of the DOS, Amiga and Atari
+// versions and the LZ-Huffman packed bank of the Windows 3.1 version. The
+// file is dropped when the size of a source file changes.
+struct UnpackCache {
+
+	enum {
+		kKindBank, // keyed by the MemEntry bank fields
+		kKindData, // keyed by the resource number, bankPos and packedSize are the number and the source size
+	};
+
+	enum {
+		kSourcesCount = 16,
+		kHeaderSize = 8 + kSourcesCount * 4, // magic, version, source file sizes
+		kRecordHeaderSize = 20,
+		kAlignment = 64, // the records and their data start at a cache line boundary
+		kMaxEntries = 512,
+	};
+
+	static bool _enabled;
+	static bool _buildOnStart;
+
+	char _path[MAXPATHLEN];
+	uint8_t _header[kHeaderSize];
+	File _f;
+	bool _isOpen;
+	uint32_t _fileSize;
+	UnpackCacheEntry _entries[kMaxEntries];
+	int _entriesCount;
+	int _hits, _misses;
+
+	UnpackCache();
+	~UnpackCache();
+
+	bool init(const char *dataDir, const uint32_t *sourceSizes);
+	bool create();
+	bool readEntries();
+	const UnpackCacheEntry *find(const MemEntry *me) const;
+	const UnpackCacheEntry *findData(int num, uint32_t sourceSize) const;
+	bool read(const UnpackCacheEntry *e, uint8_t *dst); // the cache is emptied if the data does not match
+	void add(const MemEntry *me, const uint8_t *data);
+	void addData(int num, uint32_t sourceSize, const uint8_t *data, uint32_t size);
+	void append(const UnpackCacheEntry *key, const uint8_t *data);
+};
+
+#endif
@@ -511,6 +511,10 @@ void Video::copyBitmapPtr(const uint8_t *src, uint32_t size) {
 	}
 }
 
+void Video::copyBitmap5551(const uint16_t *src) {
+	_graphics->drawBitmap(_buffers[0], (const uint8_t *)src, SCREEN_WIDTH, SCREEN_HEIGHT, FMT_RGB5551);
+}
+
 static void readPaletteWin31(const uint8_t *buf, int num, Color pal[16]) {
 	const uint8_t *p = buf + num * 16 * sizeof(uint16_t);
 	for (int i = 0; i < 16; ++i) {
@@ -77,6 +77,7 @@ struct Video {
 	void copyPage(uint8_t src, uint8_t dst, int16_t vscroll);
 	void scaleBitmap(const uint8_t *src, int fmt);
 	void copyBitmapPtr(const uint8_t *src, uint32_t size = 0);
+	void copyBitmap5551(const uint16_t *src);
 	void changePal(uint8_t pal);
 	void updateDisplay(uint8_t page, SystemStub *stub);
 	void captureDisplay();
@@ -0,0 +1,157 @@
+
+#include "wavcache.h"
+#include "mixer.h"
+#include "util.h"
+
+WavCache::WavCache()
+	: _mix(0), _entriesCount(0), _bytesCount(0), _useCounter(0), _hits(0), _misses(0), _recycled(0), _bytesSaved(0) {
+	for (int i = 0; i < kChannelsCount; ++i) {
+		_channels[i] = -1;
+	}
+}
+
+WavCache::~WavCache() {
+	debug(DBG_SND, "WavCache hits %d misses %d recycled %d bytes saved %d entries %d bytes %d", _hits, _misses, _recycled, _bytesSaved, _entriesCount, _bytesCount);
+	clear();
+}
+
+const uint8_t *WavCache::find(const char *path, int channel, uint32_t *size) {
+	assert(channel < kChannelsCount);
+	for (int i = 0; i < _entriesCount; ++i) {
+		WavCacheEntry *e = &_entries[i];
+		if (strcmp(e->path, path) == 0) {
+			e->lastUse = ++_useCounter;
+			if (_channels[channel] != i) {
+				unpin(channel);
+				_channels[channel] = i;
+			}
+			++_hits;
+			_bytesSaved += e->size;
+			*size = e->size;
+			return e->data;
+		}
+	}
+	++_misses;
+	return 0;
+}
+
+// returns a buffer for a sound missing from the cache, 0 if it does not fit
+uint8_t *WavCache::allocData(const char *path, int channel, uint32_t size, uint32_t *capacity) {
+	assert(channel < kChannelsCount);
+	if (strlen(path) >= sizeof(_entries[0].path) || size > kMaxBytes / 2) {
+		return 0;
+	}
+	unpin(channel);
+	uint8_t *data = 0;
+	if (!evict(size, &data, capacity)) {
+		return 0;
+	}
+	if (data) {
+		++_recycled;
+	} else {
+		data = (uint8_t *)malloc(size);
+		if (!data) {
+			warning("Failed to allocate %d bytes (WavCache)", size);
+			return 0;
+		}
+		*capacity = size;
+	}
+	return data;
+}
+
+// takes ownership of the data returned by allocData()
+const uint8_t *WavCache::add(const char *path, int channel, uint8_t *data, uint32_t size, uint32_t capacity) {
+	assert(_entriesCount < kMaxEntries && _bytesCount + capacity <= kMaxBytes);
+	const int index = _entriesCount++;
+	WavCacheEntry *e = &_entries[index];
+	strcpy(e->path, path);
+	e->data = data;
+	e->size = size;
+	e->capacity = capacity;
+	e->lastUse = ++_useCounter;
+	e->releasing = false;
+	_bytesCount += capacity;
+	_channels[channel] = index;
+	return data;
+}
+
+void WavCache::unpin(int channel) {
+	const int index = _channels[channel];
+	if (index >= 0) {
+		WavCacheEntry *e = &_entries[index];
+		e->lastUse = ++_useCounter;
+		if (_mix) {
+			// the command playing the next sound on the channel is pushed after the lookup
+			e->releasing = true;
+			e->releasePos = _mix->getCommandPosition() + 1;
+		}
+		_channels[channel] = -1;
+	}
+}
+
+bool WavCache::isPinned(int index) {
+	for (int i = 0; i < kChannelsCount; ++i) {
+		if (_channels[i] == index) {
+			return true;
+		}
+	}
+	WavCacheEntry *e = &_entries[index];
+	if (e->releasing) {
+		if (!_mix->isCommandDrained(e->releasePos)) {
+			return true;
+		}
+		e->releasing = false;
+	}
+	return false;
+}
+
+// frees the least recently used entries until there is room for size bytes,
+// the first evicted buffer large enough is returned in spare instead of being freed
+bool WavCache::evict(uint32_t size, uint8_t **spare, uint32_t *spareCapacity) {
+	while (_entriesCount == kMaxEntries || _bytesCount + (*spare ? *spareCapacity : size) > kMaxBytes) {
+		int lru = -1;
+		for (int i = 0; i < _entriesCount; ++i) {
+			if (!isPinned(i) && (lru < 0 || _entries[i].lastUse < _entries[lru].lastUse)) {
+				lru = i;
+			}
+		}
+		if (lru < 0) {
+			if (*spare) {
+				free(*spare);
+				*spare = 0;
+			}
+			return false;
+		}
+		debug(DBG_SND, "WavCache evicting '%s' size %d", _entries[lru].path, _entries[lru].size);
+		_bytesCount -= _entries[lru].capacity;
+		if (!*spare && _entries[lru].capacity >= size && _entries[lru].capacity / 2 <= size) {
+			*spare = _entries[lru].data;
+			*spareCapacity = _entries[lru].capacity;
+		} else {
+			free(_entries[lru].data);
+		}
+		// the last entry takes the freed slot
+		const int last = _entriesCount - 1;
+		if (lru != last) {
+			_entries[lru] = _entries[last];
+			for (int i = 0; i < kChannelsCount; ++i) {
+				if (_channels[i] == last) {
+					_channels[i] = lru;
+				}
+			}
+		}
+		--_entriesCount;
+	}
+	return true;
+}
+
+void WavCache::clear() {
+	for (int i = 0; i < _entriesCount; ++i) {
+		free(_entries[i].data);
+	}
+	_entriesCount = 0;
+	_bytesCount = 0;
+	for (int i = 0; i < kChannelsCount; ++i) {
+		_channels[i] = -1;
+	}
+}
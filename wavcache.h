@@ -0,0 +1,54 @@
+
+#ifndef WAV_CACHE_H__
+#define WAV_CACHE_H__
+
+#include "intern.h"
+
+struct WavCacheEntry {
+	char path[128];
+	uint8_t *data; // allocated with malloc
+	uint32_t size;
+	uint32_t capacity; // allocated size, recycled buffers can be larger than the sound
+	uint32_t lastUse;
+	bool releasing;
+	uint32_t releasePos; // mixer command replacing the entry on its channel
+};
+
+struct Mixer;
+
+// Decoded sounds of the 20th anniversary edition kept in memory and keyed
+// by the path of the .wgz file. The least recently used entries are freed
+// first, the ones referenced by a mixer channel are never freed. An entry
+// replaced on its channel is kept until the mixer has drained the command
+// playing the new sound. The buffers of the evicted entries are reused for
+// the sounds decoded next.
+struct WavCache {
+
+	enum {
+		kMaxEntries = 64,
+		kMaxBytes = 2 * 1024 * 1024,
+		kChannelsCount = 4,
+	};
+
+	Mixer *_mix;
+	WavCacheEntry _entries[kMaxEntries];
+	int _entriesCount;
+	uint32_t _bytesCount;
+	uint32_t _useCounter;
+	int _channels[kChannelsCount]; // index of the entry played by the channel, -1 if none
+	int _hits, _misses, _recycled;
+	uint32_t _bytesSaved; // decoded bytes served from the cache
+
+	WavCache();
+	~WavCache();
+
+	const uint8_t *find(const char *path, int channel, uint32_t *size);
+	uint8_t *allocData(const char *path, int channel, uint32_t size, uint32_t *capacity);
+	const uint8_t *add(const char *path, int channel, uint8_t *data, uint32_t size, uint32_t capacity);
+	void unpin(int channel);
+	bool isPinned(int index);
+	bool evict(uint32_t size, uint8_t **spare, uint32_t *spareCapacity);
+	void clear();
+};
+
+#endif